@@ -12,10 +12,23 @@
  *
  * Asciipes Fik for good luck
  */
+#define _POSIX_C_SOURCE 200809L // mmap, fstat, sysconf, mkstemp, fsync
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // Constants
 #define CHUNK 128	// Size to use for cell by default
@@ -32,28 +45,181 @@
 #define VAR_LEN_INDEX 2 // Len of variable identifier one number 0-9
 #define VAR_LEN_NAME 6 // Len of variable identifier "def _", etc.
 #define FIND_LEN 5 // Minimal length of [find .*] selection
+#define FINDANY_LEN 8 // Minimal length of [findany .*] selection
+#define MATCH_LEN 7 // Length of "[match " beginning [match REGEX] selection
+#define REGEX_MAX_STATES 4096 // Most DFA states of [match REGEX], else invalid
 #define SET_LEN 5 // Minimal length of set .*
+#define READ_BLOCK 65536 // How many bytes to read from the file at once
+#define ARENA_BLOCK 1048576 // Default size of one block of cell arena
+#define WRITE_BLOCK 65536 // Output is collected and written in blocks
+#define TMP_SUFFIX ".XXXXXX" // Name of temporary output is name of file + this
+#define MAX_LINKS 40 // Most symbolic links followed to the output file
+#define MAX_SIMD_STOPS 8 // Most characters scan_stops looks for at once
+#define MAX_JOBS 64 // Most threads the input can be loaded with, see -j
+#define LOAD_JOB_MIN 4194304 // Least bytes of input worth a thread of its own
+#define WRITE_JOB_ROWS 4096 // Rows formatted by one thread of write_table at once
+// Classes of characters in delim_t, a character can only be in one of them
+#define CLASS_DELIM 1
+#define CLASS_QUOTE 2
+#define CLASS_BACKSLASH 4
+#define CLASS_NEWLINE 8
+#define END_OF_INPUT -3 // Returned by read_cell when there is nothing to read
+#define UNBALANCED -4 // Returned by read_cell if the input ends inside quotes
+#define MIN_SHRINK 16 // Rows and cols arrays are never shrunk below this size
+#define SPARSE_MIN_COLS 16 // Rows with fewer cells are always stored dense
+#define SPARSE_RATIO 4 // Row with at most 1/4 of its cells non-empty is sparse
+// What is known about the numeric value of a cell, see get_cell_numeric
+#define NUM_UNKNOWN 0 // content was not parsed since it was last set
+#define NUM_VALID 1 // whole content is a number
+#define NUM_INVALID 2 // content only starts with a number, or not even that
+#define CELL_MAX_SIZE (1 << 29) // Greatest power of 2 size of col_t holds
+// State of numeric shadow of a column, see column_shadow
+#define SHADOW_NONE 0 // not built since the column last changed
+#define SHADOW_BUILT 1
+#define SHADOW_SKIP 2 // column has too few numbers to be worth one
+#define SHADOW_MIN_ROWS 1024 // Fewer rows are aggregated cell by cell
+#define SUMMARY_UNKNOWN -2 // Row of shadow summary which has to be looked for
+#define SMALL_INT 2147483648.0 // Integers below it are summed by shadow summary
+#define EXACT_SUM 9007199254740992 // Integers up to it are exact doubles
+#define FAST_MAX_DIGITS 19 // Most significant digits parse_number collects
+#define FAST_MAX_EXP 22 // Greatest power of ten which is an exact double
+#define NUMBER_LEN 32 // Room for any number format_number writes, with '\0'
+
+// Build with -DALLOC_STATS to count how many times rows and cols arrays of
+// the table were allocated or resized, the count is printed at exit
+#ifdef ALLOC_STATS
+unsigned long no_resizes = 0;
+#define COUNT_RESIZE() no_resizes++
+void print_resizes(void)
+{
+	fprintf(stderr, "Rows and cols resized %lu times\n", no_resizes);
+}
+#else
+#define COUNT_RESIZE()
+#endif
 
 // Structures
 typedef struct
 {
 	int length; // Length is the length of the actual content
-	int size; // Size is the currently allocated size of content
+	unsigned size : 30; // Size is the currently allocated size of content, 0
+	// if borrowed from the mapped file or the arena of the table, it is a
+	// power of 2 up to CELL_MAX_SIZE
+	unsigned num_state : 2; // NUM_UNKNOWN until num is parsed from content
 	char *content;
+	double num; // Value content starts with, once num_state is known
 } col_t;
 
+// Dense row stores its cells from the first one on, cell of column j is
+// cols[j]. Sparse row stores just some of its cells, cols[k] is the cell of
+// column index[k] and index is sorted, the other cells are empty.
 typedef struct
 {
-	int no_cols;
+	int no_cols;	// number of stored cells
+	int size_cols;	// allocated size of cols, and index if the row is sparse
 	col_t *cols;
+	int *index;	// column of each stored cell, NULL if the row is dense
 } row_t;
 
+// Cell contents read from the input are stored one after another in blocks
+typedef struct arena_block
+{
+	struct arena_block *next;
+	size_t size;	// allocated size of data
+	size_t used;	// number of bytes of data already taken
+	char data[];
+} arena_block_t;
+
+// Node of Fenwick tree over blocks of 64 rows of a shadow, it sums a run of
+// blocks ending with its own, as many as the lowest set bit of its index
+typedef struct
+{
+	int64_t int_sum;	// sum of the integer values below SMALL_INT
+	int no_valid;	// how many rows are numbers
+	int no_filled;	// how many rows are not empty
+} fenwick_t;
+
+// Numbers of one column of the table one after another, so that aggregates
+// over many rows do not have to look up every cell
+typedef struct
+{
+	int state;	// SHADOW_NONE, SHADOW_BUILT or SHADOW_SKIP
+	int no_rows;	// rows of the table it has values of
+	double *values;	// number every cell starts with, 0 for empty cells
+	uint64_t *valid;	// bit i is set if the cell of row i is a number
+	uint64_t *filled;	// bit i is set if the cell of row i is not empty
+	fenwick_t *tree;	// sums of runs of blocks, NULL until boxes need it
+	// Summary of all the rows, kept up to date as cells change
+	int no_valid;	// how many rows are numbers
+	int no_large;	// how many values are not integers below SMALL_INT
+	int64_t int_sum;	// sum of the values which are
+	int64_t magnitude;	// sum of their absolute values
+	int min_row;	// first row with the least number, -1 if there is none
+	int max_row;	// first row with the greatest number, -1 if none
+	int first_row;	// first row which is a number, no_rows if none
+} shadow_t;
+
+// Only rows and cells which were written to are stored, the rest of the table
+// is empty and exists just as no_rows and no_cols. Stored rows are kept in a
+// gap buffer, rows not in use form a gap in front of row gap so that rows are
+// inserted and deleted only by moving the gap there.
 typedef struct
 {
 	int no_rows;
-	row_t *rows;
+	int no_cols;	// rows may store fewer cells, the rest are empty
+	int no_stored;	// the first no_stored rows are stored
+	int size_rows;	// allocated size of rows, including the gap
+	int gap;	// index of the row the gap is in front of
+	row_t *rows;	// use table_row to get a row by its index
+	char *map;	// mapped input file cells may borrow content from, or NULL
+	size_t map_len;
+	arena_block_t *arena;	// arena cells may borrow content from
+	shadow_t *shadows;	// numeric shadows of columns, NULL until one is built
+	int size_shadows;	// allocated size of shadows
 } table_t;
 
+// Delimiters given by -d, looked up by character instead of searched through
+typedef struct
+{
+	char *chars;	// the delimiters themselves, first one is used for output
+	unsigned char class[256];	// CLASS_* of every character, 0 if ordinary
+	char *stops;	// quote, backslash, delimiters and newline for scan_stops
+	int no_stops;	// length of stops
+} delim_t;
+
+/**
+ * Buffered input, the file is read in blocks of READ_BLOCK bytes. Cells are
+ * unescaped in place inside of the buffer and copied out from there.
+ * If the file is mapped, cells are left in the buffer and only referenced.
+ */
+typedef struct
+{
+	FILE *file;
+	char *buf;
+	size_t size;	// allocated size of buf
+	size_t len;	// number of valid bytes in buf
+	size_t pos;	// index of the first byte not read yet
+	bool mapped;	// buf is the whole file mapped into memory
+} reader_t;
+
+// Buffered output, rows are formatted into buf and written in blocks
+typedef struct
+{
+	FILE *file;	// NULL if buf only grows and its owner writes it out
+	char *buf;
+	size_t size;	// allocated size of buf
+	size_t len;	// number of bytes waiting in buf
+	size_t written;	// number of bytes passed to the writer so far
+} writer_t;
+
+// Result is written into a temporary file which then replaces the target
+typedef struct
+{
+	FILE *file;
+	char *name;	// file the result replaces, links resolved, NULL for stdout
+	char *tmp_name;	// temporary file in the same directory as name
+} output_t;
+
 // What type of selection CELL is for [R,C], ROW if for [R,_] and so on
 typedef enum { CELL, ROW, COL, BOX, TABLE, MIN, MAX, STR, TMP_VAR,
 	INVALID_S } stype_t;
@@ -80,6 +246,30 @@ const cmd_types_t cmd_types_s[] = { VARIABLE, MODIFICATION, DATA, SELECTION,
 const char TEMP_cmd_type_list[][13] = { "VARIABLE", "MODIFICATION", "DATA",
 	"SELECTION", "CONTROL", "INVALID" };
 
+// How str of STR selection is looked for, [find STR], [findany A|B] or
+// [match REGEX]
+typedef enum { FIND_ONE, FIND_ANY, FIND_REGEX } ftype_t;
+
+// Patterns of STR selection, compiled once they are first looked for. A single
+// pattern is found by Horspool's algorithm, more of them at once by
+// Aho-Corasick automaton. Regular expression is compiled into DFA as soon as
+// it is parsed.
+typedef struct
+{
+	ftype_t type;
+	const char *pattern;	// unescaped str of the selection, NULL if automaton
+	int length;
+	int shift[256];	// how far the window moves by its last character
+	unsigned char class[256];	// class of each character in the automaton,
+	// 0 for characters no pattern contains
+	int no_classes;
+	int *next;	// next state by state * no_classes + class of character
+	bool *accept;	// if a pattern ends in the state, or in its suffix
+	bool *accept_end;	// if regex matches when the cell ends in the state
+	int dead;	// state regex can not match from anymore, -1 if none
+	int idle;	// state of regex with no match in progress
+} finder_t;
+
 // Structure containing current selection of rows and columns
 typedef struct
 {
@@ -89,8 +279,22 @@ typedef struct
 	int row2;
 	int col2;
 	char *str;
+	ftype_t find;	// how str is looked for, FIND_ONE by default
+	finder_t *finder;	// NULL until str is looked for, see selection_finder
 } selection_t;
 
+// Goes through cells of rows row1 up to row2 and columns col1 up to col2, row
+// by row, from either end
+typedef struct
+{
+	int row1;
+	int col1;
+	int row2;
+	int col2;
+	int row;	// current cell
+	int col;
+} cell_iter_t;
+
 typedef struct
 {
 	cmd_types_t type;
@@ -110,9 +314,66 @@ typedef struct
 	int count_s;	// amount of selections stored in array
 	command_t *commands;
 	selection_t *selections;
-	char *delim;
+	delim_t *delim;
 } call_t;
 
+// Node of NFA a regex is parsed into, CHAR moves by a character of set,
+// SPLIT and JUMP move without one, BEGIN and END only at the cell's ends
+typedef enum { NFA_CHAR, NFA_SPLIT, NFA_JUMP, NFA_BEGIN, NFA_END,
+	NFA_MATCH } ntype_t;
+
+typedef struct
+{
+	ntype_t type;
+	int out;	// next node, -1 until the fragment is connected
+	int out2;	// second next node of SPLIT
+	unsigned char set[32];	// bitmap of characters CHAR moves by
+} nfa_node_t;
+
+// Part of NFA being parsed, out of end is not connected yet
+typedef struct
+{
+	int start;
+	int end;
+} frag_t;
+
+typedef struct
+{
+	nfa_node_t *nodes;
+	int no_nodes;
+	int size_nodes;
+	const char *regex;
+	int pos;	// position of parser in regex
+	bool error;	// if the regex is malformed
+	call_t *call;
+} nfa_t;
+
+// Sets of NFA nodes which became states of DFA, so far
+typedef struct
+{
+	int *items;	// nodes of all the sets one after another
+	int no_items;
+	int size_items;
+	int *offsets;	// where set of a state begins in items, no_states + 1
+	int no_states;
+	int size_states;
+	int buckets[2 * REGEX_MAX_STATES];	// hash table of states, -1 if empty
+} dfa_sets_t;
+
+// State of a call applied to the table one row at a time
+typedef struct
+{
+	call_t *call;
+	int *rows;	// index of the next row coming to each command
+	table_t table;	// owns cells of the row currently going through
+	reader_t reader;
+	writer_t writer;	// writes into tmp
+	FILE *tmp;	// rows coming out of the last command
+	FILE *tmp_lengths;	// length in bytes and number of cells of those rows
+	int width;	// most cells in a row without trailing empty cells
+	delim_t *delim;
+} stream_t;
+
 typedef struct
 {
 	char *values[MAX_VAR];
@@ -124,7 +385,9 @@ typedef struct
 // Constructors and destructors
 void cell_dtor(col_t *col)
 {
-	free(col->content);
+	// Borrowed content belongs to the mapped file or arena
+	if (col->size != 0)
+		free(col->content);
 	col->content = NULL;
 }
 
@@ -135,16 +398,119 @@ void row_dtor(row_t *row)
 	for(int i = 0; i < row->no_cols; i++)
 		cell_dtor(&row->cols[i]);
 	free(row->cols);
+	free(row->index);
 	row->cols = NULL;
+	row->index = NULL;
+	row->no_cols = 0;
+	row->size_cols = 0;
+}
+
+// Remove all cells of the row, space for them is kept
+void row_clear(row_t *row)
+{
+	for (int i = 0; i < row->no_cols; i++)
+		cell_dtor(&row->cols[i]);
+	row->no_cols = 0;
+}
+
+void shadow_dtor(shadow_t *shadow)
+{
+	free(shadow->values);
+	free(shadow->valid);
+	free(shadow->filled);
+	free(shadow->tree);
+	shadow->values = NULL;
+	shadow->valid = NULL;
+	shadow->filled = NULL;
+	shadow->tree = NULL;
+	shadow->state = SHADOW_NONE;
+}
+
+// Forget shadows of all columns once rows moved
+void table_drop_shadows(table_t *table)
+{
+	for (int i = 0; i < table->size_shadows; i++)
+		shadow_dtor(&table->shadows[i]);
+}
+
+/**
+ * Move shadows along with columns when an empty column is added in front of
+ * or after each of columns first to last, the new ones have none
+ */
+void table_spread_shadows(table_t *table, int first, int last, bool after)
+{
+	int size = table->size_shadows;
+	if (first >= size)
+		return;
+	if (last >= size)
+		last = size - 1;
+	int added = last - first + 1;
+	shadow_t *moved = malloc((size + added) * sizeof(shadow_t));
+	if (moved == NULL)
+	{
+		// Shadows are built again once they are needed
+		table_drop_shadows(table);
+		free(table->shadows);
+		table->shadows = NULL;
+		table->size_shadows = 0;
+		return;
+	}
+	for (int i = 0; i < size + added; i++)
+		moved[i] = (shadow_t) { .state = SHADOW_NONE, .no_rows = 0,
+			.values = NULL, .valid = NULL, .filled = NULL, .tree = NULL };
+	for (int j = 0; j < size; j++)
+	{
+		int to = j;
+		if (j > last)
+			to = j + added;
+		else if (j >= first)
+			to = j + (j - first) + (after ? 0 : 1);
+		moved[to] = table->shadows[j];
+	}
+	free(table->shadows);
+	table->shadows = moved;
+	table->size_shadows = size + added;
+}
+
+// Forget shadows of columns first to last as they are removed, others move
+void table_remove_shadows(table_t *table, int first, int last)
+{
+	int size = table->size_shadows;
+	if (first >= size)
+		return;
+	int end = last < size ? last + 1 : size;
+	for (int j = first; j < end; j++)
+		shadow_dtor(&table->shadows[j]);
+	memmove(&table->shadows[first], &table->shadows[end],
+			(size - end) * sizeof(shadow_t));
+	table->size_shadows -= end - first;
 }
 
 void table_dtor(table_t *table)
 {
-	for (int i = 0; i < table->no_rows; i++)
-		row_dtor(&table->rows[i]);
+	table_drop_shadows(table);
+	free(table->shadows);
+	table->shadows = NULL;
+	table->size_shadows = 0;
+	int gap_len = table->size_rows - table->no_stored;
+	for (int i = 0; i < table->no_stored; i++)
+		row_dtor(&table->rows[i < table->gap ? i : i + gap_len]);
 	free(table->rows);
 	table->rows = NULL;
 	table->no_rows = 0;
+	table->no_cols = 0;
+	table->no_stored = 0;
+	table->size_rows = 0;
+	table->gap = 0;
+	if (table->map != NULL)
+		munmap(table->map, table->map_len);
+	table->map = NULL;
+	while (table->arena != NULL)
+	{
+		arena_block_t *next = table->arena->next;
+		free(table->arena);
+		table->arena = next;
+	}
 }
 
 void command_dtor(command_t *cmd)
@@ -157,6 +523,14 @@ void selection_dtor(selection_t *sel)
 {
 	free(sel->str);
 	sel->str = NULL;
+	if (sel->finder != NULL)
+	{
+		free(sel->finder->next);
+		free(sel->finder->accept);
+		free(sel->finder->accept_end);
+	}
+	free(sel->finder);
+	sel->finder = NULL;
 }
 
 void call_dtor(call_t *call)
@@ -225,128 +599,161 @@ void alloc_fail_nothing()
 	exit(EXIT_FAILURE);
 }
 
+// New cell is empty, the "" is borrowed until something is set
 col_t col_ctor(void)
 {
-	col_t new_col = {.length = 0, .size = 0, .content = NULL };
+	col_t new_col = {.length = 0, .size = 0, .content = "" };
 	return new_col;
 
 }
 
 row_t row_ctor(int no_cols)
 {
-	row_t new_row = { .no_cols=no_cols, .cols=NULL };
+	row_t new_row = { .no_cols=no_cols, .size_cols=0, .cols=NULL,
+		.index=NULL };
 	return new_row;
 }
 
-void row_alloc(row_t *row, table_t *table, FILE *file)
+// What rows and cells which are not stored read as
+const row_t empty_row = { .no_cols = 0, .size_cols = 0, .cols = NULL,
+	.index = NULL };
+const col_t empty_cell = { .length = 0, .size = 0, .content = "" };
+
+// Get stored row by its index, skipping over the gap
+row_t *table_stored_row(table_t *table, int row)
 {
-	col_t *col_ptr = malloc(row->no_cols * sizeof(col_t));
-	if (col_ptr == NULL)
-		alloc_fail(table, file);
-	row->cols = col_ptr;
+	if (row >= table->gap)
+		row += table->size_rows - table->no_stored;
+	return &table->rows[row];
 }
 
-void col_alloc(col_t *col, table_t *table, FILE *file)
+/**
+ * Get row of the table to read it, row which is not stored is empty_row.
+ * Row may have fewer cells than the table, see table_cell.
+ */
+const row_t *table_row(const table_t *table, int row)
 {
-	col->size = CHUNK;
-	col->content = realloc(col->content, col->size);
-	if (col->content == NULL)
-		alloc_fail(table, file);
-	strcpy(col->content, "");
+	if (row >= table->no_stored)
+		return &empty_row;
+	return table_stored_row((table_t *) table, row);
 }
 
 /**
- * Set content for according cell of the table
- * @param table_t *table - table in which to make the change
- * @param int row - index of row where to set it
- * @param int col - index of column where to set it
- * @param char *value - new value by which to replace content
+ * Find the first stored cell of a sparse row which is in column col or after
+ * @return int - index of the cell in cols, no_cols if there is none
  */
-void set_cell_value(table_t *table, int row, int col, char *value, void *freeptr)
+int row_find(const row_t *row, int col)
 {
-	int len_new = strlen(value);
-	int *size;
-	size = &table->rows[row].cols[col].size;
-	char **content;
-	content = &table->rows[row].cols[col].content;
-	// if content buffer is too small double the size, +1 for '\0'
-	while (*size < len_new + 1)
-	{
-		*size = *size * 2;
-		*content = realloc(*content, *size);
-		if (content == NULL)
-		{
-			free(freeptr);
-			alloc_fail_table(table);
-		}
-	}
-	strcpy(*content, value);
-	table->rows[row].cols[col].length = len_new;
-	// If the new cell content would be significantly smaller, shrink it
-	while (*size / 2 > len_new + 1 && *size > CHUNK)
+	int low = 0;
+	int high = row->no_cols;
+	while (low < high)
 	{
-		*size = *size / 2;
-		// Can it even fail? Well better be sure
-		*content = realloc(*content, *size);
-		if (content == NULL)
-		{
-			free(freeptr);
-			alloc_fail_table(table);
-		}
+		int mid = low + (high - low) / 2;
+		if (row->index[mid] < col)
+			low = mid + 1;
+		else
+			high = mid;
 	}
+	return low;
 }
 
-// Same as set_cell_value but called while file is still open, thus if
-// allocation fails it will close it
-void fill_cell_value(FILE *file, table_t *table, int row, int col, char *value)
+// Number of columns up to the last stored cell of the row
+int row_width(const row_t *row)
 {
-	int len_new = strlen(value);
-	int *size;
-	size = &table->rows[row].cols[col].size;
-	char **content;
-	content = &table->rows[row].cols[col].content;
-	// if content buffer is too small double the size, +1 for '\0'
-	while (*size < len_new + 1)
-	{
-		*size = *size * 2;
-		*content = realloc(*content, *size);
-		if (content == NULL)
-			alloc_fail(table, file);
-	}
-	strcpy(*content, value);
-	table->rows[row].cols[col].length = len_new;
+	if (row->index == NULL)
+		return row->no_cols;
+	return row->no_cols == 0 ? 0 : row->index[row->no_cols - 1] + 1;
 }
 
- table_t table_ctor(int no_rows, int no_cols, FILE *file)
+// Row is worth storing sparse if few enough of its cells are filled
+bool row_sparse_enough(int filled, int width)
 {
-	// Create table itself
-	row_t *row_ptr = malloc(no_rows * sizeof(row_t));
-	table_t table = {no_rows, row_ptr};
-	if (row_ptr == NULL)
-		alloc_fail(&table, file);
+	return width >= SPARSE_MIN_COLS && filled * SPARSE_RATIO <= width;
+}
 
-	// Create rows
-	for (int i = 0; i < no_rows; i++)
-		table.rows[i] = row_ctor(no_cols);
+// Number of non-empty cells of the row
+int row_filled(const row_t *row)
+{
+	int filled = 0;
+	for (int i = 0; i < row->no_cols; i++)
+		filled += row->cols[i].length != 0;
+	return filled;
+}
 
-	// Allocate rows
-	for (int i = 0; i < no_rows; i++)
+// Get cell of a row to read it, cell which is not stored is empty_cell
+const col_t *row_cell(const row_t *stored, int col)
+{
+	if (stored->index != NULL)
 	{
-		row_alloc(&table.rows[i], &table, file);
-
-		// Create columns
-		for (int j = 0; j < no_cols; j++)
-			table.rows[i].cols[j] = col_ctor();
+		int k = row_find(stored, col);
+		if (k < stored->no_cols && stored->index[k] == col)
+			return &stored->cols[k];
+		return &empty_cell;
 	}
+	return col < stored->no_cols ? &stored->cols[col] : &empty_cell;
+}
 
-	// Allocate cells
-	for (int i = 0; i < no_rows; i++)
-		for (int j = 0; j < no_cols; j++)
-			col_alloc(&table.rows[i].cols[j], &table, file);
+// Get cell of the table to read it, cell which is not stored is empty_cell
+const col_t *table_cell(const table_t *table, int row, int col)
+{
+	return row_cell(table_row(table, row), col);
+}
+
+/**
+ * Move the gap in front of row, only rows between the old and the new place
+ * of the gap are moved
+ */
+void table_move_gap(table_t *table, int row)
+{
+	int gap_len = table->size_rows - table->no_stored;
+	if (row == table->gap)
+		return;
+	if (row < table->gap)
+		memmove(&table->rows[row + gap_len], &table->rows[row],
+				(table->gap - row) * sizeof(row_t));
+	else
+		memmove(&table->rows[table->gap], &table->rows[table->gap + gap_len],
+				(row - table->gap) * sizeof(row_t));
+	table->gap = row;
+}
 
-	return table;
+/**
+ * Store a copy of string of given length into the arena of table
+ * @return char* - the copy, NULL if allocation failed
+ */
+char *arena_store(table_t *table, const char *string, size_t length)
+{
+	arena_block_t *block = table->arena;
+	if (block == NULL || block->size - block->used < length + 1)
+	{
+		size_t size = ARENA_BLOCK;
+		if (size < length + 1)
+			size = length + 1;
+		block = malloc(sizeof(arena_block_t) + size);
+		if (block == NULL)
+			return NULL;
+		block->size = size;
+		block->used = 0;
+		// A string too big for a block of its own does not end the current one
+		if (size != ARENA_BLOCK && table->arena != NULL)
+		{
+			block->next = table->arena->next;
+			table->arena->next = block;
+		}
+		else
+		{
+			block->next = table->arena;
+			table->arena = block;
+		}
+	}
+	char *copy = block->data + block->used;
+	memcpy(copy, string, length);
+	copy[length] = '\0';
+	block->used += length + 1;
+	return copy;
 }
 
+
 // Pass table in case it fails and we must deallocate
 call_t call_ctor(void)
 {
@@ -454,13 +861,6 @@ void variable_store(table_t *table, variables_t *variables, int index, char *val
 }
 
 
-void row_swap(row_t *a, row_t *b)
-{
-	row_t temp = *a;
-	*a = *b;
-	*b = temp;
-}
-
 void col_swap(col_t *a, col_t *b)
 {
 	col_t temp = *a;
@@ -469,81 +869,314 @@ void col_swap(col_t *a, col_t *b)
 }
 
 /**
- * Append multiple rows to the end of the table, for performance reasons
+ * Store count rows with no cells in front of stored row, row can be the
+ * first one not stored. The gap grows twice when it is used up, so appending
+ * is amortized constant too.
  */
-void table_add_rows(table_t *table, int count)
+void table_store_rows(table_t *table, int row, int count)
 {
-	int first_uninit = table->no_rows; // index of first row not initialised
-	table->no_rows += count;
-	row_t *new_ptr = realloc(table->rows, table->no_rows * sizeof(row_t));
-	if (new_ptr == NULL)
-		alloc_fail_table(table);
-	table->rows = new_ptr;
-	for (int i = first_uninit; i < table->no_rows; i++)
+	if (table->size_rows - table->no_stored < count)
 	{
-		table->rows[i].no_cols = table->rows[1].no_cols;
-		row_alloc(&table->rows[i], table, NULL);
-		for (int j = 0; j < table->rows[i].no_cols; j++)
-			table->rows[i].cols[j] = col_ctor();
-		for (int j = 0; j < table->rows[i].no_cols; j++)
-			col_alloc(&table->rows[i].cols[j], table, NULL);
+		// Gap at the end is simply extended by realloc
+		table_move_gap(table, table->no_stored);
+		int size = table->size_rows * 2;
+		if (size < table->no_stored + count)
+			size = table->no_stored + count;
+		row_t *new_ptr = realloc(table->rows, size * sizeof(row_t));
+		COUNT_RESIZE();
+		if (new_ptr == NULL)
+			alloc_fail_table(table);
+		table->rows = new_ptr;
+		table->size_rows = size;
 	}
+	table_move_gap(table, row);
+	for (int i = 0; i < count; i++)
+		table->rows[table->gap++] = row_ctor(0);
+	table->no_stored += count;
+}
+
+/**
+ * Insert count empty rows in front of row, only rows in between stored rows
+ * have to be stored
+ */
+void table_insert_rows(table_t *table, int row, int count)
+{
+	// Rows appended at the end do not move any, shadows are just too short
+	if (row < table->no_rows)
+		table_drop_shadows(table);
+	if (row < table->no_stored)
+		table_store_rows(table, row, count);
+	table->no_rows += count;
 }
 
 /**
- * removes last row from table
+ * Remove row from the table, it becomes a part of the gap. Once only
+ * a quarter of rows is used they are halved, so that a row added right
+ * after does not have to grow them again.
  */
-void table_delete_row(table_t *table)
+void table_remove_row(table_t *table, int row)
 {
-	int last = --table->no_rows;
-	row_dtor(&table->rows[last]);
-	row_t *new_ptr = realloc(table->rows, table->no_rows * sizeof(row_t));
-	if (new_ptr == NULL && table->no_rows != 0)
+	table_drop_shadows(table);
+	table->no_rows--;
+	if (row >= table->no_stored)
+		return;
+	table_move_gap(table, row + 1);
+	row_dtor(&table->rows[row]);
+	table->gap = row;
+	table->no_stored--;
+	if (table->no_stored > table->size_rows / 4
+			|| table->size_rows <= MIN_SHRINK)
+		return;
+	table_move_gap(table, table->no_stored);
+	row_t *new_ptr = realloc(table->rows,
+			table->size_rows / 2 * sizeof(row_t));
+	COUNT_RESIZE();
+	if (new_ptr == NULL)
 		alloc_fail_table(table);
 	table->rows = new_ptr;
+	table->size_rows /= 2;
 }
 
+/**
+ * Append count empty cells to the row, cols grows at least twice if it is
+ * too small
+ */
 void row_add_cols(row_t *row, table_t *table, int count)
 {
 	int first_uninit = row->no_cols;
+	if (row->no_cols + count > row->size_cols)
+	{
+		int size = row->size_cols * 2;
+		if (size < row->no_cols + count)
+			size = row->no_cols + count;
+		col_t *new_ptr = realloc(row->cols, size * sizeof(col_t));
+		COUNT_RESIZE();
+		if (new_ptr == NULL)
+			alloc_fail_table(table);
+		row->cols = new_ptr;
+		row->size_cols = size;
+	}
 	row->no_cols += count;
-	col_t *new_ptr = realloc(row->cols, row->no_cols * sizeof(col_t));
-	if (new_ptr == NULL)
-		alloc_fail_table(table);
-	row->cols = new_ptr;
 	for (int i = first_uninit; i < row->no_cols; i++)
-	{
 		row->cols[i] = col_ctor();
-		col_alloc(&row->cols[i], table, NULL);
-	}
 }
 
 /**
- * Append count column to end of each row, for the sake of performance
+ * Make a sparse row out of non-empty cells of a dense row, empty cells are
+ * freed and the dense row keeps just its cols array
+ * @param row_t *sparse - where to store the new row
+ * @param row_t *dense - row to take the cells from
+ * @param int size - room for how many cells to make, at least the filled ones
+ * @return boolean - false if allocation failed, dense row is left as it was
  */
-void table_add_cols(table_t *table, int count)
+bool row_pack(row_t *sparse, row_t *dense, int size)
 {
-	for (int i = 0; i < table->no_rows; i++)
-		row_add_cols(&table->rows[i], table, count);
+	*sparse = row_ctor(0);
+	if (size > 0)
+	{
+		sparse->cols = malloc(size * sizeof(col_t));
+		sparse->index = malloc(size * sizeof(int));
+		if (sparse->cols == NULL || sparse->index == NULL)
+		{
+			row_dtor(sparse);
+			return false;
+		}
+		sparse->size_cols = size;
+	}
+	// Row with no filled cells needs none stored, so it stays dense
+	for (int j = 0; j < dense->no_cols; j++)
+	{
+		if (dense->cols[j].length == 0)
+		{
+			cell_dtor(&dense->cols[j]);
+			continue;
+		}
+		sparse->cols[sparse->no_cols] = dense->cols[j];
+		sparse->index[sparse->no_cols++] = j;
+	}
+	dense->no_cols = 0;
+	return true;
 }
 
-void row_delete_col(row_t *row, table_t *table)
+// Store sparse row dense again, cells between the stored ones are added
+void row_unpack(row_t *row, table_t *table)
 {
-	int last = --row->no_cols;
-	free(row->cols[last].content);
-	col_t *new_ptr = realloc(row->cols, row->no_cols * sizeof(col_t));
-	if (new_ptr == NULL)
+	int width = row_width(row);
+	col_t *cols = malloc(width * sizeof(col_t));
+	COUNT_RESIZE();
+	if (cols == NULL)
 		alloc_fail_table(table);
-	row->cols = new_ptr;
+	for (int j = 0; j < width; j++)
+		cols[j] = col_ctor();
+	for (int k = 0; k < row->no_cols; k++)
+		cols[row->index[k]] = row->cols[k];
+	free(row->cols);
+	free(row->index);
+	row->cols = cols;
+	row->index = NULL;
+	row->no_cols = width;
+	row->size_cols = width;
+}
+
+/**
+ * Get cell of a sparse row to change it, the cell is stored first if it was
+ * not. Row filled over a half of its width is stored dense again.
+ */
+col_t *row_sparse_cell(row_t *row, table_t *table, int col)
+{
+	int k = row_find(row, col);
+	if (k < row->no_cols && row->index[k] == col)
+		return &row->cols[k];
+	if (row->no_cols == row->size_cols)
+	{
+		int size = row->size_cols * 2;
+		col_t *new_cols = realloc(row->cols, size * sizeof(col_t));
+		if (new_cols == NULL)
+			alloc_fail_table(table);
+		row->cols = new_cols;
+		int *new_index = realloc(row->index, size * sizeof(int));
+		COUNT_RESIZE();
+		if (new_index == NULL)
+			alloc_fail_table(table);
+		row->index = new_index;
+		row->size_cols = size;
+	}
+	memmove(&row->cols[k + 1], &row->cols[k],
+			(row->no_cols - k) * sizeof(col_t));
+	memmove(&row->index[k + 1], &row->index[k],
+			(row->no_cols - k) * sizeof(int));
+	row->cols[k] = col_ctor();
+	row->index[k] = col;
+	row->no_cols++;
+	if (row->no_cols * 2 <= row_width(row))
+		return &row->cols[k];
+	row_unpack(row, table);
+	return &row->cols[col];
+}
+
+/**
+ * Get cell of the table to change it, the row and the cell are stored first
+ * if they were not. Dense row which would be mostly empty cells up to col is
+ * made sparse instead. Once the content is set, table_cell_changed has to be
+ * called.
+ */
+col_t *table_cell_write(table_t *table, int row, int col)
+{
+	if (row >= table->no_stored)
+		table_store_rows(table, table->no_stored, row + 1 - table->no_stored);
+	row_t *stored = table_stored_row(table, row);
+	if (stored->index == NULL && col >= stored->no_cols
+			&& row_sparse_enough(stored->no_cols + 1, col + 1))
+	{
+		row_t sparse;
+		if (!row_pack(&sparse, stored, row_filled(stored) + 1))
+			alloc_fail_table(table);
+		row_dtor(stored);
+		*stored = sparse;
+	}
+	if (stored->index != NULL)
+		return row_sparse_cell(stored, table, col);
+	if (col >= stored->no_cols)
+		row_add_cols(stored, table, col + 1 - stored->no_cols);
+	return &stored->cols[col];
+}
+
+/**
+ * Insert an empty cell in front of col, cells from col on move by one
+ */
+void row_insert_col(row_t *row, table_t *table, int col)
+{
+	if (row->index != NULL)
+	{
+		// Only columns of the cells move, empty cell is not stored
+		for (int k = row_find(row, col); k < row->no_cols; k++)
+			row->index[k]++;
+		return;
+	}
+	if (col >= row->no_cols)
+		return;
+	row_add_cols(row, table, 1);
+	memmove(&row->cols[col + 1], &row->cols[col],
+			(row->no_cols - col - 1) * sizeof(col_t));
+	row->cols[col] = col_ctor();
+}
+
+/**
+ * Insert an empty cell in front of each cell from first to last, or after
+ * each of them if after is set. Cells are moved just once, from the end.
+ */
+void row_spread_cols(row_t *row, table_t *table, int first, int last,
+		bool after)
+{
+	if (row->index != NULL)
+	{
+		for (int k = row_find(row, first); k < row->no_cols; k++)
+		{
+			if (row->index[k] > last)
+				row->index[k] += last - first + 1;
+			else
+				row->index[k] += row->index[k] - first + !after;
+		}
+		return;
+	}
+	if (last >= row->no_cols)
+		last = row->no_cols - 1;
+	if (first > last)
+		return;
+	int count = last - first + 1;
+	int old_cols = row->no_cols;
+	row_add_cols(row, table, count);
+	memmove(&row->cols[last + 1 + count], &row->cols[last + 1],
+			(old_cols - last - 1) * sizeof(col_t));
+	for (int i = last; i >= first; i--)
+	{
+		// Cell and its new neighbour take two places in its stead
+		int pair = first + 2 * (i - first);
+		row->cols[pair + !after] = row->cols[i];
+		row->cols[pair + after] = col_ctor();
+	}
 }
 
 /**
- * removes last column from each row
+ * Remove cells from first to last, the rest is moved over them at once.
+ * cols is halved when only a quarter of it is used, same as rows of table.
  */
-void table_delete_col(table_t *table)
+void row_remove_cols(row_t *row, int first, int last)
 {
-	for (int i = 0; i < table->no_rows; i++)
-		row_delete_col(&table->rows[i], table);
+	if (row->index != NULL)
+	{
+		int from = row_find(row, first);
+		int to = row_find(row, last + 1);
+		for (int k = from; k < to; k++)
+			cell_dtor(&row->cols[k]);
+		memmove(&row->cols[from], &row->cols[to],
+				(row->no_cols - to) * sizeof(col_t));
+		memmove(&row->index[from], &row->index[to],
+				(row->no_cols - to) * sizeof(int));
+		row->no_cols -= to - from;
+		for (int k = from; k < row->no_cols; k++)
+			row->index[k] -= last - first + 1;
+		return;
+	}
+	if (last >= row->no_cols)
+		last = row->no_cols - 1;
+	if (first > last)
+		return;
+	for (int i = first; i <= last; i++)
+		cell_dtor(&row->cols[i]);
+	memmove(&row->cols[first], &row->cols[last + 1],
+			(row->no_cols - last - 1) * sizeof(col_t));
+	row->no_cols -= last - first + 1;
+	if (row->no_cols > row->size_cols / 4 || row->size_cols <= MIN_SHRINK)
+		return;
+	// Smaller block can always be made, keep the old one if not
+	col_t *new_ptr = realloc(row->cols, row->size_cols / 2 * sizeof(col_t));
+	COUNT_RESIZE();
+	if (new_ptr != NULL)
+	{
+		row->cols = new_ptr;
+		row->size_cols /= 2;
+	}
 }
 
 /**
@@ -555,487 +1188,1962 @@ void table_delete_col(table_t *table)
  */
 char *get_cell_content(const table_t *table, int row, int col)
 {
-	return table->rows[row].cols[col].content;
+	return table_cell(table, row, col)->content;
 }
 
-// same as  get_cell_content but stores numeric value into *var
-// return false if it is not numeric cell
-bool get_cell_numeric(const table_t *table, int row, int col, double *var)
-{
-	char *content = get_cell_content(table, row, col);
-	char *endptr = NULL;
-	*var = strtod(content, &endptr);
-	if (strlen(content) == 0)
-		return false;
-	int length = strlen(endptr);
-	for (int i = 0; i < length; i++)
-		if (endptr[i] != ' ')
-			return false;
-
-	if (length == 0)
-		return true;
-	else
-		return false;
-}
+// Powers of ten up to FAST_MAX_EXP, all of them are exact doubles
+const double exact_powers[FAST_MAX_EXP + 1] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+	1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-// Find the cell with minimal value from table and old store it into new
-bool find_min_cell(const table_t *table, selection_t old, selection_t *new)
+/**
+ * Parse the number the string starts with, same as strtod does. Decimal
+ * number whose digits fit into 53 bits and whose exponent is at most 22 is
+ * exact after a single multiplication or division by a power of ten, the
+ * rest (inf, nan, hexadecimal, leading spaces, long or huge numbers) is left
+ * to strtod.
+ * @param const char *str - where the number starts
+ * @param char **end - where to store the end of the number
+ * @return double - the number, 0 if there is none
+ */
+double parse_number(const char *str, char **end)
 {
-	double num = 0;
-	bool no_min = true;
-	double min;
-	new->type = CELL;
-	switch (old.type)
+#if FLT_EVAL_METHOD != 0
+	// Without plain double arithmetic the result could be rounded twice
+	return strtod(str, end);
+#endif
+	const char *p = str;
+	bool negative = *p == '-';
+	if (*p == '-' || *p == '+')
+		p++;
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool any = false;
+	for (bool point = false; ; p++)
 	{
-		case CELL:
-			if (get_cell_numeric(table, old.row1 - 1, old.col1 - 1, &num))
-			{
-					new->row1 = old.row1;
-					new->col1 = old.col1;
-					return true;
-			}
-			else
-				return false;
-			break;
-		case ROW:
-			for (int i = 0; i < table->rows[0].no_cols; i++)
-			{
-				if (get_cell_numeric(table, old.row1 - 1, i, &num))
-				{
-					if (no_min || num < min)
-					{
-						min = num;
-						no_min = false;
-						new->row1 = old.row1;
-						new->col1 = i + 1; // since selections start at 1
-					}
-				}
-			}
-			if (new->col1 == 0)
-				return false;
-			return true;
-			break;
-		case COL:
-			for (int i = 0; i < table->no_rows; i++)
-			{
-				if (get_cell_numeric(table, i, old.col1 - 1, &num))
-				{
-					if (no_min || num < min)
-					{
-						min = num;
-						no_min = false;
-						new->row1 = i + 1; // since selections start at 1
-						new->col1 = old.col1;
-					}
-				}
-			}
-			if (new->row1 == 0)
-				return false;
-			return true;
+		if (*p == '.' && !point)
+		{
+			point = true;
+			continue;
+		}
+		if (*p < '0' || *p > '9')
 			break;
-		case BOX:
-			if (old.row2 == SLASH)
-				old.row2 = table->no_rows;
-			if (old.col2 == SLASH)
-				old.col2 = table->rows[0].no_cols;
-			for (int i = old.row1 - 1; i < old.row2; i++)
+		any = true;
+		// Leading zeros are not significant, but they still move the point
+		if (mantissa != 0 || *p != '0')
+		{
+			if (digits == FAST_MAX_DIGITS)
+				return strtod(str, end);
+			mantissa = mantissa * 10 + (*p - '0');
+			digits++;
+		}
+		exponent -= point;
+	}
+	// Hexadecimal number would end at its x
+	if (!any || *p == 'x' || *p == 'X')
+		return strtod(str, end);
+	if (*p == 'e' || *p == 'E')
+	{
+		const char *q = p + 1;
+		bool negative_exp = *q == '-';
+		if (*q == '-' || *q == '+')
+			q++;
+		// Exponent with no digits is not a part of the number
+		if (*q >= '0' && *q <= '9')
+		{
+			int value = 0;
+			for (; *q >= '0' && *q <= '9'; q++)
+				if (value < 10000)
+					value = value * 10 + (*q - '0');
+			exponent += negative_exp ? -value : value;
+			p = q;
+		}
+	}
+	if (mantissa > (uint64_t) 1 << 53 || (mantissa != 0
+				&& (exponent < -FAST_MAX_EXP || exponent > FAST_MAX_EXP)))
+		return strtod(str, end);
+	*end = (char *) p;
+	double value = mantissa;
+	if (exponent < 0 && mantissa != 0)
+		value /= exact_powers[-exponent];
+	else if (mantissa != 0)
+		value *= exact_powers[exponent];
+	return negative ? -value : value;
+}
+
+/**
+ * Store numeric value of the cell into *var, it is parsed just once and kept
+ * in the cell until its content is set again
+ * @return boolean - false if it is not numeric cell, *var is the number its
+ * content starts with anyway
+ */
+bool cell_numeric(const col_t *cell, double *var)
+{
+	// Empty cell may be the shared empty_cell, nothing is cached in it
+	if (cell->length == 0)
+	{
+		*var = 0.0;
+		return false;
+	}
+	if (cell->num_state == NUM_UNKNOWN)
+	{
+		// Cache does not change the content, so the cell is still const
+		col_t *cache = (col_t *) cell;
+		char *endptr = NULL;
+		cache->num = parse_number(cell->content, &endptr);
+		cache->num_state = *endptr == '\0' ? NUM_VALID : NUM_INVALID;
+	}
+	*var = cell->num;
+	return cell->num_state == NUM_VALID;
+}
+
+// same as  get_cell_content but stores numeric value into *var
+// return false if it is not numeric cell
+bool get_cell_numeric(const table_t *table, int row, int col, double *var)
+{
+	return cell_numeric(table_cell(table, row, col), var);
+}
+
+// Is the cell of row a number according to the shadow
+bool shadow_valid(const shadow_t *shadow, int row)
+{
+	return shadow->valid[row / 64] >> (row % 64) & 1;
+}
+
+// Is the value counted by the summary's sum of integers
+bool shadow_small(double value)
+{
+	return value > -SMALL_INT && value < SMALL_INT && value == (int64_t) value;
+}
+
+// Add the value of a row to the summary, or take it away if sign is -1
+void shadow_count(shadow_t *shadow, double value, int sign)
+{
+	if (shadow_small(value))
+	{
+		shadow->int_sum += sign * (int64_t) value;
+		shadow->magnitude += sign * (int64_t) fabs(value);
+	}
+	else
+		shadow->no_large += sign;
+}
+
+// Part of the value in the summary's sum of integers
+int64_t shadow_int(double value)
+{
+	return shadow_small(value) ? (int64_t) value : 0;
+}
+
+// Is the cell of the row of the shadow not empty
+bool shadow_filled(const shadow_t *shadow, int row)
+{
+	return shadow->filled[row / 64] >> (row % 64) & 1;
+}
+
+// Add part to the sum, or take it away if sign is -1
+void fenwick_add(fenwick_t *sum, fenwick_t part, int sign)
+{
+	sum->int_sum += sign * part.int_sum;
+	sum->no_valid += sign * part.no_valid;
+	sum->no_filled += sign * part.no_filled;
+}
+
+// Sum rows first up to end of the shadow, which are in the same block
+fenwick_t shadow_block(const shadow_t *shadow, int first, int end)
+{
+	fenwick_t sum = { .int_sum = 0, .no_valid = 0, .no_filled = 0 };
+	if (first == end)
+		return sum;
+	for (int i = first; i < end; i++)
+		sum.int_sum += shadow_int(shadow->values[i]);
+	uint64_t mask = ~(uint64_t) 0 >> (64 - (end - first)) << (first % 64);
+	sum.no_valid = __builtin_popcountll(shadow->valid[first / 64] & mask);
+	sum.no_filled = __builtin_popcountll(shadow->filled[first / 64] & mask);
+	return sum;
+}
+
+// Sum the first blocks of the shadow from nodes of its Fenwick tree
+fenwick_t shadow_blocks(const shadow_t *shadow, int blocks)
+{
+	fenwick_t sum = { .int_sum = 0, .no_valid = 0, .no_filled = 0 };
+	for (int i = blocks; i > 0; i -= i & -i)
+		fenwick_add(&sum, shadow->tree[i], 1);
+	return sum;
+}
+
+// Sum rows from and up to to of the shadow, whole blocks from the tree
+fenwick_t shadow_range(const shadow_t *shadow, int from, int to)
+{
+	fenwick_t sum = shadow_blocks(shadow, to / 64);
+	fenwick_add(&sum, shadow_block(shadow, to - to % 64, to), 1);
+	fenwick_add(&sum, shadow_blocks(shadow, from / 64), -1);
+	fenwick_add(&sum, shadow_block(shadow, from - from % 64, from), -1);
+	return sum;
+}
+
+/**
+ * Make shadow longer by empty rows appended to the table, they are 0 and not
+ * numbers, which changes only first_row of the summary
+ * @return boolean - false if it could not be allocated
+ */
+bool shadow_grow(shadow_t *shadow, int no_rows)
+{
+	int old = shadow->no_rows;
+	int words = (no_rows + 63) / 64;
+	double *values = realloc(shadow->values, no_rows * sizeof(double));
+	if (values != NULL)
+		shadow->values = values;
+	uint64_t *valid = realloc(shadow->valid, words * sizeof(uint64_t));
+	if (valid != NULL)
+		shadow->valid = valid;
+	uint64_t *filled = realloc(shadow->filled, words * sizeof(uint64_t));
+	if (filled != NULL)
+		shadow->filled = filled;
+	if (values == NULL || valid == NULL || filled == NULL)
+		return false;
+	for (int i = old; i < no_rows; i++)
+		values[i] = 0.0;
+	if (old % 64 != 0)
+	{
+		valid[old / 64] &= ((uint64_t) 1 << (old % 64)) - 1;
+		filled[old / 64] &= ((uint64_t) 1 << (old % 64)) - 1;
+	}
+	for (int i = (old + 63) / 64; i < words; i++)
+	{
+		valid[i] = 0;
+		filled[i] = 0;
+	}
+	if (shadow->tree != NULL)
+	{
+		fenwick_t *tree = realloc(shadow->tree,
+				(words + 1) * sizeof(fenwick_t));
+		if (tree == NULL)
+		{
+			// It is built again once it is needed
+			free(shadow->tree);
+			shadow->tree = NULL;
+		}
+		else
+		{
+			shadow->tree = tree;
+			// Runs of new nodes have only the old blocks they start in
+			int old_words = (old + 63) / 64;
+			fenwick_t none = { .int_sum = 0, .no_valid = 0, .no_filled = 0 };
+			for (int i = old_words + 1; i <= words; i++)
 			{
-				for (int j = old.col1 - 1; j < old.col2; j++)
+				int start = i - (i & -i);
+				tree[i] = none;
+				if (start < old_words)
 				{
-					if (get_cell_numeric(table, i, j, &num))
-					{
-						if (no_min || num < min)
-						{
-							min = num;
-							no_min = false;
-							new->row1 = i + 1; // since selections start at 1
-							new->col1 = j + 1; // since selections start at 1
-						}
-					}
+					fenwick_add(&tree[i], shadow_blocks(shadow, old_words), 1);
+					fenwick_add(&tree[i], shadow_blocks(shadow, start), -1);
 				}
 			}
-			if (new->row1 == 0 || new->col1 == 0)
-				return false;
-			return true;
-			break;
-		case TABLE:
-			for (int i = 0; i < table->no_rows; i++)
+		}
+	}
+	if (shadow->first_row == old)
+		shadow->first_row = no_rows;
+	shadow->no_rows = no_rows;
+	return true;
+}
+
+/**
+ * Keep the least, or the greatest, number row of the summary up to date when
+ * row changes from old to value. If the row was that number and got worse,
+ * the rows have to be looked through again.
+ * @param int *best - min_row or max_row of the summary
+ */
+void shadow_track(const shadow_t *shadow, int *best, int row, double old,
+		double value, bool valid, bool max)
+{
+	if (*best == SUMMARY_UNKNOWN)
+		return;
+	bool number = valid && !isnan(value);
+	if (*best == row)
+	{
+		if (!number || (max ? value < old : value > old))
+			*best = SUMMARY_UNKNOWN;
+		return;
+	}
+	if (number && (*best < 0 || (max ? value > shadow->values[*best]
+					: value < shadow->values[*best])
+				|| (value == shadow->values[*best] && row < *best)))
+		*best = row;
+}
+
+// Add change of a row to all nodes of the Fenwick tree whose runs have it
+void shadow_tree_add(shadow_t *shadow, int row, fenwick_t change)
+{
+	int blocks = (shadow->no_rows + 63) / 64;
+	for (int i = row / 64 + 1; i <= blocks; i += i & -i)
+		fenwick_add(&shadow->tree[i], change, 1);
+}
+
+/**
+ * Change value of a row of the shadow, along with the summary
+ * @param bool valid - the cell is a number
+ * @param bool filled - the cell is not empty
+ */
+void shadow_change(shadow_t *shadow, int row, double value, bool valid,
+		bool filled)
+{
+	double old = shadow->values[row];
+	if (shadow->tree != NULL)
+	{
+		fenwick_t change = { .int_sum = shadow_int(value) - shadow_int(old),
+			.no_valid = (int) valid - (int) shadow_valid(shadow, row),
+			.no_filled = (int) filled - (int) shadow_filled(shadow, row) };
+		shadow_tree_add(shadow, row, change);
+	}
+	shadow_count(shadow, old, -1);
+	shadow_count(shadow, value, 1);
+	shadow->no_valid += (int) valid - (int) shadow_valid(shadow, row);
+	shadow_track(shadow, &shadow->min_row, row, old, value, valid, false);
+	shadow_track(shadow, &shadow->max_row, row, old, value, valid, true);
+	if (valid && shadow->first_row != SUMMARY_UNKNOWN
+			&& row < shadow->first_row)
+		shadow->first_row = row;
+	else if (!valid && row == shadow->first_row)
+		shadow->first_row = SUMMARY_UNKNOWN;
+	shadow->values[row] = value;
+	if (valid)
+		shadow->valid[row / 64] |= (uint64_t) 1 << (row % 64);
+	else
+		shadow->valid[row / 64] &= ~((uint64_t) 1 << (row % 64));
+	if (filled)
+		shadow->filled[row / 64] |= (uint64_t) 1 << (row % 64);
+	else
+		shadow->filled[row / 64] &= ~((uint64_t) 1 << (row % 64));
+}
+
+/**
+ * Build Fenwick tree of the shadow unless it has one, so that sums over any
+ * rows take only a few of its nodes and two partial blocks. Blocks are words
+ * of the bitmaps, the tree is 64 times smaller than the shadow that way.
+ * @return boolean - false if it could not be allocated
+ */
+bool shadow_tree(shadow_t *shadow)
+{
+	if (shadow->tree != NULL)
+		return true;
+	int no_rows = shadow->no_rows;
+	int blocks = (no_rows + 63) / 64;
+	fenwick_t *tree = malloc((blocks + 1) * sizeof(fenwick_t));
+	if (tree == NULL)
+		return false;
+	for (int i = 1; i <= blocks; i++)
+	{
+		int first = (i - 1) * 64;
+		tree[i] = shadow_block(shadow, first,
+				no_rows - first > 64 ? first + 64 : no_rows);
+		// Run of the node is its block after runs of the nodes right before
+		for (int k = 1; k < (i & -i); k *= 2)
+			fenwick_add(&tree[i], tree[i - k], 1);
+	}
+	shadow->tree = tree;
+	return true;
+}
+
+/**
+ * Get numeric shadow of the column, it is built if the column changed since
+ * @return shadow_t* - NULL if the table has too few rows or the column
+ * too few numbers for it to pay off, or if it could not be allocated
+ */
+shadow_t *column_shadow(table_t *table, int col)
+{
+	if (table->no_rows < SHADOW_MIN_ROWS)
+		return NULL;
+	if (col >= table->size_shadows)
+	{
+		int size = table->no_cols > col ? table->no_cols : col + 1;
+		shadow_t *new_ptr = realloc(table->shadows, size * sizeof(shadow_t));
+		if (new_ptr == NULL)
+			return NULL;
+		for (int i = table->size_shadows; i < size; i++)
+			new_ptr[i] = (shadow_t) { .state = SHADOW_NONE, .no_rows = 0,
+				.values = NULL, .valid = NULL, .filled = NULL, .tree = NULL };
+		table->shadows = new_ptr;
+		table->size_shadows = size;
+	}
+	shadow_t *shadow = &table->shadows[col];
+	// Rows appended since are empty, other changes of rows move them
+	if (shadow->state == SHADOW_BUILT && shadow->no_rows < table->no_rows
+			&& !shadow_grow(shadow, table->no_rows))
+		shadow_dtor(shadow);
+	if (shadow->state != SHADOW_NONE && shadow->no_rows != table->no_rows)
+		shadow_dtor(shadow);
+	if (shadow->state == SHADOW_NONE)
+	{
+		int no_rows = table->no_rows;
+		shadow->no_rows = no_rows;
+		shadow->values = malloc(no_rows * sizeof(double));
+		shadow->valid = calloc((no_rows + 63) / 64, sizeof(uint64_t));
+		shadow->filled = calloc((no_rows + 63) / 64, sizeof(uint64_t));
+		if (shadow->values == NULL || shadow->valid == NULL
+				|| shadow->filled == NULL)
+		{
+			shadow_dtor(shadow);
+			return NULL;
+		}
+		shadow->no_valid = 0;
+		shadow->no_large = 0;
+		shadow->int_sum = 0;
+		shadow->magnitude = 0;
+		for (int i = 0; i < no_rows; i++)
+		{
+			const col_t *cell = table_cell(table, i, col);
+			if (cell_numeric(cell, &shadow->values[i]))
 			{
-				for (int j = 0; j < table->rows[0].no_cols; j++)
-				{
-					if (get_cell_numeric(table, i, j, &num))
-					{
-						if (no_min || num < min)
-						{
-							min = num;
-							no_min = false;
-							new->row1 = i + 1; // since selections start at 1
-							new->col1 = j + 1; // since selections start at 1
-						}
-					}
-				}
+				shadow->valid[i / 64] |= (uint64_t) 1 << (i % 64);
+				shadow->no_valid++;
 			}
-			if (new->row1 == 0 || new->col1 == 0)
-				return false;
-			return true;
-			break;
-		case MIN:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case MAX:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case STR:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case TMP_VAR:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case INVALID_S:
-			// This will never occur
+			if (cell->length != 0)
+				shadow->filled[i / 64] |= (uint64_t) 1 << (i % 64);
+			shadow_count(shadow, shadow->values[i], 1);
+		}
+		// Rows of the extremes are looked for only once they are needed
+		shadow->min_row = SUMMARY_UNKNOWN;
+		shadow->max_row = SUMMARY_UNKNOWN;
+		shadow->first_row = SUMMARY_UNKNOWN;
+		shadow->state = SHADOW_BUILT;
+		// Mostly text is looked at cell by cell, it is not worth the memory
+		if (shadow->no_valid < no_rows / 2)
+		{
+			shadow_dtor(shadow);
+			shadow->state = SHADOW_SKIP;
+		}
+	}
+	return shadow->state == SHADOW_BUILT ? shadow : NULL;
+}
+
+/**
+ * Get shadows of columns col1 up to col2 for an aggregate over rows of them
+ * @param int rows - how many rows the aggregate goes over
+ * @return boolean - false if any of the columns does not have one
+ */
+bool table_shadows(table_t *table, int rows, int col1, int col2)
+{
+	if (rows < SHADOW_MIN_ROWS)
+		return false;
+	for (int j = col1; j < col2; j++)
+		if (column_shadow(table, j) == NULL)
+			return false;
+	return true;
+}
+
+/**
+ * Are shadows of columns col1 up to col2 only integers whose partial sums
+ * are all exact, so that they add up the same in any order. Other numbers
+ * are summed row by row, the order of additions shows in the result.
+ */
+bool table_shadows_exact(table_t *table, int col1, int col2)
+{
+	int64_t magnitude = 0;
+	for (int j = col1; j < col2; j++)
+	{
+		const shadow_t *shadow = column_shadow(table, j);
+		magnitude += shadow->magnitude;
+		if (shadow->no_large != 0 || magnitude > EXACT_SUM)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Have columns col1 up to col2 shadows already, so that using them does not
+ * cost building them
+ * @param bool tree - they need Fenwick trees for all rows too, aggregates
+ * over few rows pay off then
+ */
+bool table_built(const table_t *table, int col1, int col2, bool tree)
+{
+	for (int j = col1; j < col2; j++)
+	{
+		if (j >= table->size_shadows)
+			return false;
+		const shadow_t *shadow = &table->shadows[j];
+		if (shadow->state != SHADOW_BUILT)
+			return false;
+		if (tree && (shadow->tree == NULL
+					|| shadow->no_rows != table->no_rows))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Bring shadow of the column up to date once the cell was changed, the
+ * shadow is changed in place instead of being built again
+ */
+void table_cell_changed(table_t *table, int row, int col)
+{
+	if (col >= table->size_shadows)
+		return;
+	shadow_t *shadow = &table->shadows[col];
+	// Column which was not worth a shadow may be now
+	if (shadow->state == SHADOW_SKIP)
+		shadow_dtor(shadow);
+	if (shadow->state != SHADOW_BUILT)
+		return;
+	if (shadow->no_rows < table->no_rows
+			&& !shadow_grow(shadow, table->no_rows))
+	{
+		shadow_dtor(shadow);
+		return;
+	}
+	if (row >= shadow->no_rows)
+		return;
+	double value = 0.0;
+	const col_t *cell = table_cell(table, row, col);
+	bool valid = cell_numeric(cell, &value);
+	shadow_change(shadow, row, value, valid, cell->length != 0);
+}
+
+/**
+ * Set content for according cell of the table
+ * @param table_t *table - table in which to make the change
+ * @param int row - index of row where to set it
+ * @param int col - index of column where to set it
+ * @param char *value - new value by which to replace content
+ */
+void set_cell_value(table_t *table, int row, int col, char *value, void *freeptr)
+{
+	int len_new = strlen(value);
+	// Buffer of the cell would need a size which does not fit
+	if (len_new + 1 > CELL_MAX_SIZE)
+	{
+		fprintf(stderr, "Cell content is too long!\n");
+		free(freeptr);
+		table_dtor(table);
+		exit(EXIT_FAILURE);
+	}
+	col_t *cell = table_cell_write(table, row, col);
+	char **content;
+	content = &cell->content;
+	// Borrowed content is never changed, the cell gets its own buffer instead
+	if (cell->size == 0)
+	{
+		cell->size = CHUNK;
+		*content = malloc(cell->size);
+		if (*content == NULL)
+		{
+			free(freeptr);
+			alloc_fail_table(table);
+		}
+	}
+	// if content buffer is too small double the size, +1 for '\0'
+	while (cell->size < len_new + 1)
+	{
+		cell->size = cell->size * 2;
+		*content = realloc(*content, cell->size);
+		if (content == NULL)
+		{
+			free(freeptr);
+			alloc_fail_table(table);
+		}
+	}
+	strcpy(*content, value);
+	cell->length = len_new;
+	cell->num_state = NUM_UNKNOWN;
+	// If the new cell content would be significantly smaller, shrink it
+	while (cell->size / 2 > len_new + 1 && cell->size > CHUNK)
+	{
+		cell->size = cell->size / 2;
+		// Can it even fail? Well better be sure
+		*content = realloc(*content, cell->size);
+		if (content == NULL)
+		{
+			free(freeptr);
+			alloc_fail_table(table);
+		}
+	}
+	table_cell_changed(table, row, col);
+}
+
+/**
+ * Sum numbers of rows from and up to to of the shadow, with SSE2 or AVX2
+ * 2 or 4 of them are added at once. Only exact shadows are summed, see
+ * table_shadows_exact, the order of additions does not matter then.
+ * @param int *count - where to add how many of them are valid
+ */
+double shadow_sum(shadow_t *shadow, int from, int to, int *count)
+{
+	// Integers whose partial sums are all exact add up the same in any order,
+	// so the sum of all rows is known from the summary, of other rows from
+	// the Fenwick tree
+	bool exact = shadow->no_large == 0 && shadow->magnitude <= EXACT_SUM;
+	if (exact && from == 0 && to == shadow->no_rows)
+	{
+		*count += shadow->no_valid;
+		return (double) shadow->int_sum;
+	}
+	if (exact && shadow_tree(shadow))
+	{
+		fenwick_t range = shadow_range(shadow, from, to);
+		*count += range.no_valid;
+		return (double) range.int_sum;
+	}
+	const double *values = shadow->values;
+	double sum = 0.0;
+	int i = from;
+#if defined(__AVX2__)
+	__m256d acc = _mm256_setzero_pd();
+	for (; to - i >= 4; i += 4)
+		acc = _mm256_add_pd(acc, _mm256_loadu_pd(values + i));
+	double lanes[4];
+	_mm256_storeu_pd(lanes, acc);
+	sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(__SSE2__)
+	__m128d acc = _mm_setzero_pd();
+	for (; to - i >= 2; i += 2)
+		acc = _mm_add_pd(acc, _mm_loadu_pd(values + i));
+	double lanes[2];
+	_mm_storeu_pd(lanes, acc);
+	sum = lanes[0] + lanes[1];
+#endif
+	for (; i < to; i++)
+		sum += values[i];
+
+	// Whole words of the bitmap are counted at once
+	for (i = from; i < to && i % 64 != 0; i++)
+		*count += shadow_valid(shadow, i);
+	for (; to - i >= 64; i += 64)
+		*count += __builtin_popcountll(shadow->valid[i / 64]);
+	for (; i < to; i++)
+		*count += shadow_valid(shadow, i);
+	return sum;
+}
+
+// Count rows from and up to to of the shadow which are not empty
+int shadow_no_filled(shadow_t *shadow, int from, int to)
+{
+	if (shadow_tree(shadow))
+		return shadow_range(shadow, from, to).no_filled;
+	int count = 0;
+	int i = from;
+	for (; i < to && i % 64 != 0; i++)
+		count += shadow_filled(shadow, i);
+	for (; to - i >= 64; i += 64)
+		count += __builtin_popcountll(shadow->filled[i / 64]);
+	for (; i < to; i++)
+		count += shadow_filled(shadow, i);
+	return count;
+}
+
+// First row from and up to to which is a number according to the shadow,
+// for all rows it is remembered in the summary
+int shadow_first(shadow_t *shadow, int from, int to)
+{
+	bool all = from == 0 && to == shadow->no_rows;
+	if (all && shadow->first_row != SUMMARY_UNKNOWN)
+		return shadow->first_row;
+	while (from < to && !shadow_valid(shadow, from))
+		from++;
+	if (all)
+		shadow->first_row = from;
+	return from;
+}
+
+/**
+ * Find the least, or the greatest, number in rows from and up to to of the
+ * shadow, NaN is left out. Cells which are not numbers are masked out, 4 or 2
+ * numbers are compared at once with AVX2 or SSE2. For all rows the row is
+ * remembered in the summary.
+ * @param bool max - look for the greatest number instead
+ * @param int *row - where to store the first row with that number
+ * @return boolean - false if there is no such number in the rows
+ */
+bool shadow_extreme(shadow_t *shadow, int from, int to, bool max, int *row)
+{
+	int *known = NULL;
+	if (from == 0 && to == shadow->no_rows)
+		known = max ? &shadow->max_row : &shadow->min_row;
+	if (known != NULL && *known != SUMMARY_UNKNOWN)
+	{
+		*row = *known;
+		return *known >= 0;
+	}
+	const double *values = shadow->values;
+	double none = max ? -INFINITY : INFINITY;
+	double best = none;
+	int i = from;
+	// Groups of 4 start at a multiple of 4, so they never span two words
+	for (; i < to && i % 4 != 0; i++)
+		if (shadow_valid(shadow, i) && (max ? values[i] > best
+					: values[i] < best))
+			best = values[i];
+#if defined(__AVX2__)
+	const __m256i bit = _mm256_set_epi64x(8, 4, 2, 1);
+	__m256d acc = _mm256_set1_pd(none);
+	__m256d fill = acc;
+	for (; to - i >= 4; i += 4)
+	{
+		__m256i bits = _mm256_set1_epi64x(shadow->valid[i / 64] >> (i % 64));
+		__m256d mask = _mm256_castsi256_pd(_mm256_cmpeq_epi64(
+					_mm256_and_si256(bits, bit), bit));
+		__m256d x = _mm256_blendv_pd(fill, _mm256_loadu_pd(values + i), mask);
+		// NaN in x is never taken over acc, same as by < and > below
+		acc = max ? _mm256_max_pd(x, acc) : _mm256_min_pd(x, acc);
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, acc);
+	for (int j = 0; j < 4; j++)
+		if (max ? lanes[j] > best : lanes[j] < best)
+			best = lanes[j];
+#elif defined(__SSE2__)
+	const __m128i bit = _mm_set_epi32(2, 2, 1, 1);
+	__m128d acc = _mm_set1_pd(none);
+	__m128d fill = acc;
+	for (; to - i >= 2; i += 2)
+	{
+		__m128i bits = _mm_set1_epi32(shadow->valid[i / 64] >> (i % 64) & 3);
+		__m128d mask = _mm_castsi128_pd(_mm_cmpeq_epi32(
+					_mm_and_si128(bits, bit), bit));
+		__m128d x = _mm_or_pd(_mm_and_pd(mask, _mm_loadu_pd(values + i)),
+				_mm_andnot_pd(mask, fill));
+		// NaN in x is never taken over acc, same as by < and > below
+		acc = max ? _mm_max_pd(x, acc) : _mm_min_pd(x, acc);
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, acc);
+	for (int j = 0; j < 2; j++)
+		if (max ? lanes[j] > best : lanes[j] < best)
+			best = lanes[j];
+#endif
+	for (; i < to; i++)
+		if (shadow_valid(shadow, i) && (max ? values[i] > best
+					: values[i] < best))
+			best = values[i];
+
+	// Infinity may be a number in the rows as well, so it is looked for
+	for (i = from; i < to; i++)
+		if (shadow_valid(shadow, i) && values[i] == best)
 			break;
+	if (known != NULL)
+		*known = i < to ? i : -1;
+	*row = i;
+	return i < to;
+}
+
+/**
+ * Find the least, or the greatest, number in rows row1 up to row2 and columns
+ * col1 up to col2 through shadows of the columns. The first one row by row
+ * wins, same as when going cell by cell, and so does a NaN found first.
+ * @return boolean - false if there is no number in the box
+ */
+bool shadows_extreme(table_t *table, int row1, int row2, int col1, int col2,
+		bool max, selection_t *new)
+{
+	int best_row = -1;
+	int best_col = -1;
+	double best = 0.0;
+	int first_row = row2;
+	int first_col = -1;
+	for (int j = col1; j < col2; j++)
+	{
+		shadow_t *shadow = column_shadow(table, j);
+		int row = shadow_first(shadow, row1, row2);
+		if (row < first_row)
+		{
+			first_row = row;
+			first_col = j;
+		}
+		if (!shadow_extreme(shadow, row1, row2, max, &row))
+			continue;
+		double value = shadow->values[row];
+		if (best_col < 0 || (max ? value > best : value < best)
+				|| (value == best && row < best_row))
+		{
+			best = value;
+			best_row = row;
+			best_col = j;
+		}
 	}
-	return false;
+	if (first_col < 0)
+		return false;
+	if (isnan(table->shadows[first_col].values[first_row]))
+	{
+		best_row = first_row;
+		best_col = first_col;
+	}
+	new->row1 = best_row + 1; // since selections start at 1
+	new->col1 = best_col + 1; // since selections start at 1
+	return true;
 }
 
-// Find the cell with minimal value from table and old store it into new
-// basically same as find_min_cell, it could somehow be one function, no time
-bool find_max_cell(const table_t *table, selection_t old, selection_t *new)
+/**
+ * Make iterator over cells of the selection, CELL is a box of one cell.
+ * Nothing is gone through for other than CELL, ROW, COL, BOX and TABLE.
+ * @param bool reverse - start from the last cell, iter_prev goes through it
+ * @return boolean - false if the selection is not a range of cells
+ */
+bool selection_iter(const table_t *table, selection_t sel, cell_iter_t *iter,
+		bool reverse)
 {
-	double num = 0;
-	bool no_max = true;
-	double max;
-	new->type = CELL;
-	switch (old.type)
+	iter->row1 = sel.row1 - 1;
+	iter->col1 = sel.col1 - 1;
+	iter->row2 = sel.row1;
+	iter->col2 = sel.col1;
+	bool range = true;
+	switch (sel.type)
 	{
 		case CELL:
-			if (get_cell_numeric(table, old.row1 - 1, old.col1 - 1, &num))
-			{
-					new->row1 = old.row1;
-					new->col1 = old.col1;
-					return true;
-			}
-			else
-				return false;
 			break;
 		case ROW:
-			for (int i = 0; i < table->rows[0].no_cols; i++)
-			{
-				if (get_cell_numeric(table, old.row1 - 1, i, &num))
-				{
-					if (no_max || num > max)
-					{
-						max = num;
-						no_max = false;
-						new->row1 = old.row1;
-						new->col1 = i + 1; // since selections start at 1
-					}
-				}
-			}
-			if (new->col1 == 0)
-				return false;
-			return true;
+			iter->col1 = 0;
+			iter->col2 = table->no_cols;
 			break;
 		case COL:
-			for (int i = 0; i < table->no_rows; i++)
-			{
-				if (get_cell_numeric(table, i, old.col1 - 1, &num))
-				{
-					if (no_max || num > max)
-					{
-						max = num;
-						no_max = false;
-						new->row1 = i + 1; // since selections start at 1
-						new->col1 = old.col1;
-					}
-				}
-			}
-			if (new->row1 == 0)
-				return false;
-			return true;
+			iter->row1 = 0;
+			iter->row2 = table->no_rows;
 			break;
 		case BOX:
-			if (old.row2 == SLASH)
-				old.row2 = table->no_rows;
-			if (old.col2 == SLASH)
-				old.col2 = table->rows[0].no_cols;
-			for (int i = old.row1 - 1; i < old.row2; i++)
-			{
-				for (int j = old.col1 - 1; j < old.col2; j++)
-				{
-					if (get_cell_numeric(table, i, j, &num))
-					{
-						if (no_max || num > max)
-						{
-							max = num;
-							no_max = false;
-							new->row1 = i + 1; // since selections start at 1
-							new->col1 = j + 1; // since selections start at 1
-						}
-					}
-				}
-			}
-			if (new->row1 == 0 || new->col1 == 0)
-				return false;
-			return true;
+			iter->row2 = sel.row2 == SLASH ? table->no_rows : sel.row2;
+			iter->col2 = sel.col2 == SLASH ? table->no_cols : sel.col2;
 			break;
 		case TABLE:
-			for (int i = 0; i < table->no_rows; i++)
+			iter->row1 = 0;
+			iter->col1 = 0;
+			iter->row2 = table->no_rows;
+			iter->col2 = table->no_cols;
+			break;
+		default:
+			range = false;
+			break;
+	}
+	if (!range || iter->row1 >= iter->row2 || iter->col1 >= iter->col2)
+	{
+		iter->row1 = iter->row2 = 0;
+		iter->col1 = iter->col2 = 0;
+	}
+	iter->row = reverse ? iter->row2 - 1 : iter->row1;
+	iter->col = reverse ? iter->col2 : iter->col1 - 1;
+	return range;
+}
+
+// Move to the next cell, false once all of them were gone through
+bool iter_next(cell_iter_t *iter)
+{
+	if (iter->row >= iter->row2)
+		return false;
+	if (++iter->col < iter->col2)
+		return true;
+	iter->col = iter->col1;
+	return ++iter->row < iter->row2;
+}
+
+// Move to the previous cell, false once all of them were gone through
+bool iter_prev(cell_iter_t *iter)
+{
+	if (iter->row < iter->row1)
+		return false;
+	if (--iter->col >= iter->col1)
+		return true;
+	iter->col = iter->col2 - 1;
+	return --iter->row >= iter->row1;
+}
+
+/**
+ * Find the cell with the least, or the greatest, value of old and store it
+ * into new, the first one row by row wins. Once the value can not be beaten,
+ * being infinity or NaN found first, the rest is not looked at.
+ * @param bool max - look for the greatest value instead
+ */
+bool find_extreme_cell(table_t *table, selection_t old, selection_t *new,
+		bool max)
+{
+	new->type = CELL;
+	cell_iter_t iter;
+	if (!selection_iter(table, old, &iter, false))
+		return false;
+	if (old.type != CELL && old.type != ROW && table_shadows(table,
+				iter.row2 - iter.row1, iter.col1, iter.col2))
+		return shadows_extreme(table, iter.row1, iter.row2, iter.col1,
+				iter.col2, max, new);
+	bool found = false;
+	double best = 0;
+	double num = 0;
+	while (iter_next(&iter))
+	{
+		if (!get_cell_numeric(table, iter.row, iter.col, &num))
+			continue;
+		if (found && !(max ? num > best : num < best))
+			continue;
+		found = true;
+		best = num;
+		new->row1 = iter.row + 1; // since selections start at 1
+		new->col1 = iter.col + 1; // since selections start at 1
+		if (isnan(best) || best == (max ? INFINITY : -INFINITY))
+			return true;
+	}
+	return found;
+}
+
+/**
+ * Build class table of characters from the -d argument
+ * @param char *chars - the delimiters
+ * @return delim_t - the table, stops have to be freed by delim_dtor
+ */
+delim_t delim_ctor(char *chars)
+{
+	delim_t new = { .chars = chars, .class = { 0 }, .stops = NULL };
+	for (int i = 0; chars[i] != '\0'; i++)
+		new.class[(unsigned char) chars[i]] = CLASS_DELIM;
+	new.class['\"'] = CLASS_QUOTE;
+	new.class['\\'] = CLASS_BACKSLASH;
+	new.class['\n'] = CLASS_NEWLINE;
+	// Inside quotes only the first two are special, writer needs all but
+	// the newline
+	new.no_stops = strlen(chars) + 3;
+	new.stops = malloc(new.no_stops + 1);
+	if (new.stops == NULL)
+		alloc_fail_nothing();
+	strcpy(new.stops, "\"\\");
+	strcat(new.stops, chars);
+	strcat(new.stops, "\n");
+	return new;
+}
+
+void delim_dtor(delim_t *delim)
+{
+	free(delim->stops);
+	delim->stops = NULL;
+}
+
+/**
+ * Return if c is one of the delimiters
+ * @param char c - character which to check
+ * @param delim_t *delim - delimiters to check against
+ * @return boolean true if is a delim character
+ */
+bool is_delim(char c, const delim_t *delim)
+{
+	return delim->class[(unsigned char) c] == CLASS_DELIM;
+}
+
+void unescape_string(char *string, table_t *table, call_t *call)
+{
+	int length = strlen(string);
+	char *new = calloc(length + 1, sizeof(char));
+	if (new == NULL)
+		alloc_fail_table_call(table, call);
+	int quote_open = false;
+	bool escaped = false;
+	char *iterator = new;
+	for (int i = 0; i < length; i++)
+	{
+		char c = string[i];
+		// Skip backslashes
+		if (c == '\\' && !escaped)
+		{
+				escaped = true;
+				continue;
+		}
+		// Handle quoting
+		if (c == '\"' && !escaped)
+		{
+			if (!quote_open)
+				quote_open = true;
+			else
+				quote_open = false;
+			continue;
+		}
+		// End of cell
+		if (!quote_open && (c == '\n' || (is_delim(c, call->delim)
+						&& !escaped)))
+			break;
+
+		*iterator++ = c;
+		escaped = false;
+	}
+	*iterator++ = '\0';
+	strcpy(string, new);
+	free(new);
+}
+
+/**
+ * Make Aho-Corasick automaton of patterns separated by | which is neither
+ * escaped nor quoted, each of them is unescaped on its own. Characters are
+ * grouped into classes of those the patterns contain, so that a state needs
+ * a transition for each class only.
+ */
+void finder_automaton(finder_t *finder, char *patterns, table_t *table,
+		call_t *call)
+{
+	int length = strlen(patterns);
+	int no_patterns = 1;
+	bool quoted = false;
+	bool escaped = false;
+	for (int i = 0; i < length; i++)
+	{
+		if (patterns[i] == '|' && !escaped && !quoted)
+		{
+			patterns[i] = '\0';
+			no_patterns++;
+		}
+		if (patterns[i] == '\"' && !escaped)
+			quoted = !quoted;
+		escaped = patterns[i] == '\\' && !escaped;
+	}
+	char **starts = malloc(no_patterns * sizeof(char *));
+	if (starts == NULL)
+		alloc_fail_table_call(table, call);
+	starts[0] = patterns;
+	for (int i = 0, j = 1; i < length; i++)
+		if (patterns[i] == '\0')
+			starts[j++] = &patterns[i + 1];
+
+	finder->pattern = NULL;
+	memset(finder->class, 0, sizeof(finder->class));
+	finder->no_classes = 1;
+	for (int i = 0; i < no_patterns; i++)
+	{
+		unescape_string(starts[i], table, call);
+		for (char *c = starts[i]; *c != '\0'; c++)
+			if (finder->class[(unsigned char) *c] == 0)
+				finder->class[(unsigned char) *c] = finder->no_classes++;
+	}
+
+	// Every character of the patterns may start a state of its own
+	int classes = finder->no_classes;
+	int size = length + 1;
+	finder->next = malloc(size * classes * sizeof(int));
+	finder->accept = calloc(size, sizeof(bool));
+	int *fail = malloc(size * sizeof(int));
+	int *queue = malloc(size * sizeof(int));
+	if (finder->next == NULL || finder->accept == NULL || fail == NULL
+			|| queue == NULL)
+		alloc_fail_table_call(table, call);
+	for (int i = 0; i < size * classes; i++)
+		finder->next[i] = -1;
+	int no_states = 1;
+	for (int i = 0; i < no_patterns; i++)
+	{
+		int state = 0;
+		for (char *c = starts[i]; *c != '\0'; c++)
+		{
+			int *next = &finder->next[state * classes
+				+ finder->class[(unsigned char) *c]];
+			if (*next < 0)
+				*next = no_states++;
+			state = *next;
+		}
+		finder->accept[state] = true;
+	}
+
+	// States are finished by depth, so the state a failure leads to is
+	// finished before and missing transitions are taken from it
+	int head = 0;
+	int tail = 0;
+	for (int c = 0; c < classes; c++)
+	{
+		int *next = &finder->next[c];
+		if (*next < 0)
+			*next = 0;
+		else
+		{
+			fail[*next] = 0;
+			queue[tail++] = *next;
+		}
+	}
+	while (head < tail)
+	{
+		int state = queue[head++];
+		finder->accept[state] |= finder->accept[fail[state]];
+		for (int c = 0; c < classes; c++)
+		{
+			int *next = &finder->next[state * classes + c];
+			int fallback = finder->next[fail[state] * classes + c];
+			if (*next < 0)
+				*next = fallback;
+			else
 			{
-				for (int j = 0; j < table->rows[0].no_cols; j++)
-				{
-					if (get_cell_numeric(table, i, j, &num))
-					{
-						if (no_max || num > max)
-						{
-							max = num;
-							no_max = false;
-							new->row1 = i + 1; // since selections start at 1
-							new->col1 = j + 1; // since selections start at 1
-						}
-					}
-				}
+				fail[*next] = fallback;
+				queue[tail++] = *next;
 			}
-			if (new->row1 == 0 || new->col1 == 0)
+		}
+	}
+	free(starts);
+	free(fail);
+	free(queue);
+}
+
+/**
+ * Get finder of [find STR] or [findany A|B] selection, the first time its
+ * str is unescaped and Horspool's shift table or the automaton is made
+ */
+const finder_t *selection_finder(table_t *table, selection_t *sel,
+		call_t *call)
+{
+	if (sel->finder != NULL)
+		return sel->finder;
+	finder_t *finder = malloc(sizeof(finder_t));
+	if (finder == NULL)
+		alloc_fail_table_call(table, call);
+	finder->type = sel->find;
+	finder->next = NULL;
+	finder->accept = NULL;
+	finder->accept_end = NULL;
+	sel->finder = finder;
+	if (sel->find == FIND_ANY)
+	{
+		finder_automaton(finder, sel->str, table, call);
+		return finder;
+	}
+	unescape_string(sel->str, table, call);
+	finder->pattern = sel->str;
+	finder->length = strlen(sel->str);
+	for (int i = 0; i < 256; i++)
+		finder->shift[i] = finder->length;
+	// Last character is left out, window ending with it moves past it
+	for (int i = 0; i < finder->length - 1; i++)
+		finder->shift[(unsigned char) sel->str[i]] = finder->length - 1 - i;
+	return finder;
+}
+
+/**
+ * Find out if the cell contains any of the patterns, the automaton takes
+ * each character of the cell just once
+ */
+bool col_any_substr(const col_t *col, const finder_t *finder)
+{
+	if (finder->accept[0])
+		return true;
+	const unsigned char *text = (const unsigned char *) col->content;
+	const int *root = finder->next;
+	int state = 0;
+	for (int i = 0; i < col->length; i++)
+	{
+		// Bytes which start no pattern are skipped without walking the
+		// automaton, the loads do not depend on each other then
+		if (state == 0)
+		{
+			while (i < col->length && root[finder->class[text[i]]] == 0)
+				i++;
+			if (i == col->length)
 				return false;
+		}
+		state = finder->next[state * finder->no_classes
+			+ finder->class[text[i]]];
+		if (finder->accept[state])
 			return true;
-			break;
-		case MIN:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case MAX:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case STR:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case TMP_VAR:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case INVALID_S:
-			// This will never occur
-			break;
 	}
 	return false;
 }
 
 /**
- * Return if c is substring of delim
- * @param char c - character which to check
- * @param char *delim - string which to check against
- * @return boolean true if is a delim character
+ * Add node to NFA, its set is empty
+ * @return index of the node
  */
-bool is_delim(char c, char *delim)
+int nfa_node(nfa_t *nfa, ntype_t type, int out, int out2)
 {
-	while (*delim)
-		if (c == *delim++)
-			return true;
-	return false;
+	if (nfa->no_nodes == nfa->size_nodes)
+	{
+		int size = nfa->size_nodes == 0 ? CHUNK : 2 * nfa->size_nodes;
+		nfa_node_t *nodes = realloc(nfa->nodes, size * sizeof(nfa_node_t));
+		if (nodes == NULL)
+		{
+			free(nfa->nodes);
+			alloc_fail_call(nfa->call);
+		}
+		nfa->nodes = nodes;
+		nfa->size_nodes = size;
+	}
+	nfa_node_t *node = &nfa->nodes[nfa->no_nodes];
+	node->type = type;
+	node->out = out;
+	node->out2 = out2;
+	memset(node->set, 0, sizeof(node->set));
+	return nfa->no_nodes++;
 }
 
-void unescape_string(char *string, table_t *table, call_t *call)
+frag_t nfa_single(nfa_t *nfa, ntype_t type)
 {
-	int length = strlen(string);
-	char *new = calloc(length + 1, sizeof(char));
-	if (new == NULL)
-		alloc_fail_table_call(table, call);
-	int quote_open = false;
-	bool escaped = false;
-	char *iterator = new;
-	for (int i = 0; i < length; i++)
+	int node = nfa_node(nfa, type, -1, -1);
+	frag_t frag = { .start = node, .end = node };
+	return frag;
+}
+
+void nfa_set_add(nfa_t *nfa, int node, unsigned char c)
+{
+	nfa->nodes[node].set[c >> 3] |= 1 << (c & 7);
+}
+
+bool nfa_set_has(const nfa_node_t *node, unsigned char c)
+{
+	return (node->set[c >> 3] >> (c & 7)) & 1;
+}
+
+/**
+ * Parse bracket expression [abc], [^a-z], ] right after [ or [^ is part
+ * of the set
+ */
+frag_t nfa_bracket(nfa_t *nfa)
+{
+	const char *re = nfa->regex;
+	frag_t frag = nfa_single(nfa, NFA_CHAR);
+	bool negate = re[nfa->pos] == '^';
+	if (negate)
+		nfa->pos++;
+	bool first = true;
+	while (re[nfa->pos] != ']' || first)
 	{
-		char c = string[i];
-		// Skip backslashes
-		if (c == '\\' && !escaped)
+		if (re[nfa->pos] == '\0')
 		{
-				escaped = true;
-				continue;
+			nfa->error = true;
+			return frag;
 		}
-		// Handle quoting
-		if (c == '\"' && !escaped)
+		unsigned char low = re[nfa->pos++];
+		unsigned char high = low;
+		if (re[nfa->pos] == '-' && re[nfa->pos + 1] != ']'
+				&& re[nfa->pos + 1] != '\0')
 		{
-			if (!quote_open)
-				quote_open = true;
-			else
-				quote_open = false;
-			continue;
+			high = re[nfa->pos + 1];
+			nfa->pos += 2;
 		}
-		// End of cell
-		if (!quote_open && (c == '\n' || (is_delim(c, call->delim)
-						&& !escaped)))
-			break;
+		if (high < low)
+			nfa->error = true;
+		for (int c = low; c <= high; c++)
+			nfa_set_add(nfa, frag.start, c);
+		first = false;
+	}
+	nfa->pos++;
+	if (negate)
+		for (int i = 0; i < 32; i++)
+			nfa->nodes[frag.start].set[i] ^= 0xff;
+	return frag;
+}
 
-		*iterator++ = c;
-		escaped = false;
+frag_t nfa_alternation(nfa_t *nfa);
+
+// Parse character, ., bracket expression, anchor or (group)
+frag_t nfa_atom(nfa_t *nfa)
+{
+	const char *re = nfa->regex;
+	char c = re[nfa->pos++];
+	if (c == '(')
+	{
+		frag_t frag = nfa_alternation(nfa);
+		if (re[nfa->pos] == ')')
+			nfa->pos++;
+		else
+			nfa->error = true;
+		return frag;
 	}
-	*iterator++ = '\0';
-	strcpy(string, new);
-	free(new);
+	if (c == '[')
+		return nfa_bracket(nfa);
+	if (c == '^')
+		return nfa_single(nfa, NFA_BEGIN);
+	if (c == '$')
+		return nfa_single(nfa, NFA_END);
+	// Nothing to repeat, or backslash at the end
+	if (c == '*' || c == '+' || c == '?' || (c == '\\' && re[nfa->pos] == '\0'))
+	{
+		nfa->error = true;
+		return nfa_single(nfa, NFA_JUMP);
+	}
+	frag_t frag = nfa_single(nfa, NFA_CHAR);
+	if (c == '.')
+		memset(nfa->nodes[frag.start].set, 0xff, 32);
+	else
+	{
+		if (c == '\\')
+			c = re[nfa->pos++];
+		nfa_set_add(nfa, frag.start, c);
+	}
+	return frag;
 }
 
-bool col_substr(col_t col, char *value)
+// Parse atom followed by any of *, + and ?
+frag_t nfa_repeat(nfa_t *nfa)
 {
-	int length = strlen(value);
-	if (length > (int) strlen(col.content))
-		return false;
+	const char *re = nfa->regex;
+	frag_t frag = nfa_atom(nfa);
+	while (re[nfa->pos] == '*' || re[nfa->pos] == '+' || re[nfa->pos] == '?')
+	{
+		char op = re[nfa->pos++];
+		int jump = nfa_node(nfa, NFA_JUMP, -1, -1);
+		int split = nfa_node(nfa, NFA_SPLIT, frag.start, jump);
+		nfa->nodes[frag.end].out = op == '?' ? jump : split;
+		if (op != '+')
+			frag.start = split;
+		frag.end = jump;
+	}
+	return frag;
+}
 
-	int match = 0;
-	for (int i = 0; col.content[i] != '\0'; i++)
+// Parse atoms up to | or ) one after another
+frag_t nfa_concat(nfa_t *nfa)
+{
+	const char *re = nfa->regex;
+	frag_t frag = nfa_single(nfa, NFA_JUMP);
+	while (!nfa->error && re[nfa->pos] != '\0' && re[nfa->pos] != '|'
+			&& re[nfa->pos] != ')')
 	{
-		if (match == length)
-			return true;
-		if (value[match] == col.content[i])
-			match++;
-		else
-			match = 0;
+		frag_t next = nfa_repeat(nfa);
+		nfa->nodes[frag.end].out = next.start;
+		frag.end = next.end;
 	}
-	return match == length;
+	return frag;
 }
 
-bool find_substr_cell(table_t *table, selection_t old, selection_t current,
-		selection_t *new, call_t *call)
+frag_t nfa_alternation(nfa_t *nfa)
 {
-	int row1 = old.row1 - 1;
-	int col1 = old.col1 - 1;
-	char *str = current.str;
-	unescape_string(str, table, call);
-	new->type = CELL;
-	switch (old.type)
+	frag_t frag = nfa_concat(nfa);
+	while (!nfa->error && nfa->regex[nfa->pos] == '|')
 	{
-		case CELL:
-			if (col_substr(table->rows[row1].cols[col1], str))
+		nfa->pos++;
+		frag_t other = nfa_concat(nfa);
+		int jump = nfa_node(nfa, NFA_JUMP, -1, -1);
+		int split = nfa_node(nfa, NFA_SPLIT, frag.start, other.start);
+		nfa->nodes[frag.end].out = jump;
+		nfa->nodes[other.end].out = jump;
+		frag.start = split;
+		frag.end = jump;
+	}
+	return frag;
+}
+
+/**
+ * Follow moves without a character from the seeds. BEGIN is passed only if
+ * begin, END only if end.
+ * @param int *set - gets nodes waiting for a character or the end, sorted
+ * @return number of nodes in set
+ */
+int nfa_closure(const nfa_t *nfa, const int *seeds, int no_seeds, bool begin,
+		bool end, bool *seen, int *stack, int *set)
+{
+	memset(seen, 0, nfa->no_nodes * sizeof(bool));
+	int top = 0;
+	for (int i = 0; i < no_seeds; i++)
+	{
+		if (!seen[seeds[i]])
+		{
+			seen[seeds[i]] = true;
+			stack[top++] = seeds[i];
+		}
+	}
+	while (top > 0)
+	{
+		const nfa_node_t *node = &nfa->nodes[stack[--top]];
+		int outs[2] = { -1, -1 };
+		if (node->type == NFA_SPLIT || node->type == NFA_JUMP
+				|| (node->type == NFA_BEGIN && begin)
+				|| (node->type == NFA_END && end))
+			outs[0] = node->out;
+		if (node->type == NFA_SPLIT)
+			outs[1] = node->out2;
+		for (int i = 0; i < 2; i++)
+		{
+			if (outs[i] >= 0 && !seen[outs[i]])
 			{
-					new->row1 = old.row1;
-					new->col1 = old.col1;
-					return true;
+				seen[outs[i]] = true;
+				stack[top++] = outs[i];
 			}
-			else
-				return false;
-			break;
-		case ROW:
-			for (int i = 0; i < table->rows[0].no_cols; i++)
+		}
+	}
+	int count = 0;
+	for (int i = 0; i < nfa->no_nodes; i++)
+	{
+		ntype_t type = nfa->nodes[i].type;
+		if (seen[i] && (type == NFA_CHAR || type == NFA_END
+					|| type == NFA_MATCH))
+			set[count++] = i;
+	}
+	return count;
+}
+
+/**
+ * Split characters into classes, characters of a class are in the sets of
+ * the same CHAR nodes, so DFA moves by all of them the same way
+ */
+void nfa_classes(const nfa_t *nfa, finder_t *finder)
+{
+	memset(finder->class, 0, sizeof(finder->class));
+	finder->no_classes = 1;
+	int split[2 * 256];
+	for (int i = 0; i < nfa->no_nodes; i++)
+	{
+		if (nfa->nodes[i].type != NFA_CHAR)
+			continue;
+		for (int j = 0; j < 2 * finder->no_classes; j++)
+			split[j] = -1;
+		int no_classes = 0;
+		for (int c = 0; c < 256; c++)
+		{
+			int key = 2 * finder->class[c] + nfa_set_has(&nfa->nodes[i], c);
+			if (split[key] < 0)
+				split[key] = no_classes++;
+			finder->class[c] = split[key];
+		}
+		finder->no_classes = no_classes;
+	}
+}
+
+unsigned dfa_hash(const int *set, int count)
+{
+	unsigned hash = 2166136261u;
+	for (int i = 0; i < count; i++)
+		hash = (hash ^ (unsigned) set[i]) * 16777619u;
+	return hash & (2 * REGEX_MAX_STATES - 1);
+}
+
+/**
+ * Get the state of the set, new one is made if the set has none. The first
+ * state is never looked up, cells begin only there.
+ * @return index of the state, -1 if there would be too many of them
+ */
+int dfa_state(dfa_sets_t *sets, finder_t *finder, const int *set, int count,
+		call_t *call)
+{
+	unsigned hash = dfa_hash(set, count);
+	for (; sets->buckets[hash] >= 0; hash = (hash + 1) & (2 * REGEX_MAX_STATES - 1))
+	{
+		int state = sets->buckets[hash];
+		int *items = &sets->items[sets->offsets[state]];
+		if (sets->offsets[state + 1] - sets->offsets[state] == count
+				&& memcmp(items, set, count * sizeof(int)) == 0)
+			return state;
+	}
+	if (sets->no_states == REGEX_MAX_STATES)
+		return -1;
+	if (sets->no_states > 0)
+		sets->buckets[hash] = sets->no_states;
+
+	if (sets->no_states == sets->size_states)
+	{
+		sets->size_states = sets->size_states == 0 ? CHUNK
+			: 2 * sets->size_states;
+		int size = sets->size_states;
+		int *offsets = realloc(sets->offsets, (size + 1) * sizeof(int));
+		if (offsets != NULL)
+			sets->offsets = offsets;
+		int *next = realloc(finder->next, size * finder->no_classes
+				* sizeof(int));
+		if (next != NULL)
+			finder->next = next;
+		bool *accept = realloc(finder->accept, size * sizeof(bool));
+		if (accept != NULL)
+			finder->accept = accept;
+		bool *accept_end = realloc(finder->accept_end, size * sizeof(bool));
+		if (accept_end != NULL)
+			finder->accept_end = accept_end;
+		if (offsets == NULL || next == NULL || accept == NULL
+				|| accept_end == NULL)
+			alloc_fail_call(call);
+		if (sets->no_states == 0)
+			sets->offsets[0] = 0;
+	}
+	while (sets->no_items + count > sets->size_items)
+	{
+		sets->size_items = sets->size_items == 0 ? CHUNK
+			: 2 * sets->size_items;
+		int *items = realloc(sets->items, sets->size_items * sizeof(int));
+		if (items == NULL)
+			alloc_fail_call(call);
+		sets->items = items;
+	}
+	memcpy(&sets->items[sets->no_items], set, count * sizeof(int));
+	sets->no_items += count;
+	sets->offsets[++sets->no_states] = sets->no_items;
+	return sets->no_states - 1;
+}
+
+/**
+ * Compile regex into DFA of finder by subset construction. The DFA looks for
+ * a match anywhere in the cell, so the start of NFA is added to every state
+ * but the first one, which is the only one ^ passes in. Once a state
+ * accepts, the DFA stays in it.
+ * Supported are characters, \ escaping the next one, ., [set], [^set],
+ * ^, $, (group), |, *, + and ?.
+ * @return false if regex is malformed or needs over REGEX_MAX_STATES states
+ */
+bool regex_compile(finder_t *finder, const char *regex, call_t *call)
+{
+	finder->type = FIND_REGEX;
+	finder->pattern = NULL;
+	finder->next = NULL;
+	finder->accept = NULL;
+	finder->accept_end = NULL;
+	finder->dead = -1;
+	nfa_t nfa = { .nodes = NULL, .no_nodes = 0, .size_nodes = 0,
+		.regex = regex, .pos = 0, .error = false, .call = call };
+	frag_t frag = nfa_alternation(&nfa);
+	if (nfa.error || regex[nfa.pos] != '\0')
+	{
+		free(nfa.nodes);
+		return false;
+	}
+	int match = nfa_node(&nfa, NFA_MATCH, -1, -1);
+	nfa.nodes[frag.end].out = match;
+	nfa_classes(&nfa, finder);
+	int classes = finder->no_classes;
+	unsigned char first[256];	// first character of each class
+	for (int c = 255; c >= 0; c--)
+		first[finder->class[c]] = c;
+
+	int n = nfa.no_nodes;
+	bool *seen = malloc(n * sizeof(bool));
+	int *stack = malloc(n * sizeof(int));
+	int *seeds = malloc((n + 1) * sizeof(int));
+	int *set = malloc(n * sizeof(int));
+	dfa_sets_t *sets = malloc(sizeof(dfa_sets_t));
+	if (seen == NULL || stack == NULL || seeds == NULL || set == NULL
+			|| sets == NULL)
+		alloc_fail_call(call);
+	sets->items = NULL;
+	sets->no_items = 0;
+	sets->size_items = 0;
+	sets->offsets = NULL;
+	sets->no_states = 0;
+	sets->size_states = 0;
+	for (int i = 0; i < 2 * REGEX_MAX_STATES; i++)
+		sets->buckets[i] = -1;
+
+	int count = nfa_closure(&nfa, &frag.start, 1, true, false, seen, stack, set);
+	dfa_state(sets, finder, set, count, call);
+	count = nfa_closure(&nfa, &frag.start, 1, false, false, seen, stack, set);
+	finder->idle = dfa_state(sets, finder, set, count, call);
+	bool ok = true;
+	for (int state = 0; ok && state < sets->no_states; state++)
+	{
+		// Items may move as states are added
+		int begin = sets->offsets[state];
+		int length = sets->offsets[state + 1] - begin;
+		finder->accept[state] = length > 0
+			&& sets->items[begin + length - 1] == match;
+		memcpy(seeds, &sets->items[begin], length * sizeof(int));
+		count = nfa_closure(&nfa, seeds, length, state == 0, true, seen, stack,
+				set);
+		finder->accept_end[state] = count > 0 && set[count - 1] == match;
+		if (length == 0 && state > 0)
+			finder->dead = state;
+		for (int c = 0; c < classes; c++)
+		{
+			if (finder->accept[state])
 			{
-				if (col_substr(table->rows[row1].cols[i], str))
-				{
-					new->row1 = old.row1;
-					new->col1 = i +  1; // since selections start at 1
-				}
+				finder->next[state * classes + c] = state;
+				continue;
 			}
-			if (new->col1 == 0)
-				return false;
-			return true;
-			break;
-		case COL:
-			for (int i = 0; i < table->no_rows; i++)
+			int no_seeds = 0;
+			for (int i = 0; i < length; i++)
 			{
-				if (col_substr(table->rows[i].cols[col1], str))
-				{
-					new->row1 = i + 1; // since selections start at 1
-					new->col1 = old.col1;
-				}
+				const nfa_node_t *node = &nfa.nodes[sets->items[begin + i]];
+				if (node->type == NFA_CHAR && nfa_set_has(node, first[c]))
+					seeds[no_seeds++] = node->out;
 			}
-			if (new->row1 == 0)
-				return false;
+			seeds[no_seeds++] = frag.start;
+			count = nfa_closure(&nfa, seeds, no_seeds, false, false, seen,
+					stack, set);
+			// finder->next may move when the state is added
+			int target = dfa_state(sets, finder, set, count, call);
+			finder->next[state * classes + c] = target;
+			ok = target >= 0;
+			if (!ok)
+				break;
+		}
+	}
+	free(nfa.nodes);
+	free(seen);
+	free(stack);
+	free(seeds);
+	free(set);
+	free(sets->items);
+	free(sets->offsets);
+	free(sets);
+	if (!ok)
+	{
+		free(finder->next);
+		free(finder->accept);
+		free(finder->accept_end);
+		finder->next = NULL;
+		finder->accept = NULL;
+		finder->accept_end = NULL;
+	}
+	return ok;
+}
+
+/**
+ * Find out if the regex matches anywhere in the cell, each character of the
+ * cell is taken just once
+ */
+bool col_match(const col_t *col, const finder_t *finder)
+{
+	const unsigned char *text = (const unsigned char *) col->content;
+	const int *idle = &finder->next[finder->idle * finder->no_classes];
+	int state = 0;
+	for (int i = 0; i < col->length; i++)
+	{
+		// Characters no match starts with leave DFA idle, they are skipped
+		// without a dependency between the loads
+		if (state == finder->idle)
+		{
+			while (i < col->length
+					&& idle[finder->class[text[i]]] == finder->idle)
+				i++;
+			if (i == col->length)
+				break;
+		}
+		if (finder->accept[state])
 			return true;
-			break;
-		case BOX:
-			if (old.row2 == SLASH)
-				old.row2 = table->no_rows;
-			if (old.col2 == SLASH)
-				old.col2 = table->rows[0].no_cols;
-			for (int i = old.row1 - 1; i < old.row2; i++)
-			{
-				for (int j = old.col1 - 1; j < old.col2; j++)
-				{
-					if (col_substr(table->rows[i].cols[j], str))
-					{
-						new->row1 = i + 1; // since selections start at 1
-						new->col1 = j + 1; // since selections start at 1
-					}
-				}
-			}
-			if (new->row1 == 0 || new->col1 == 0)
-				return false;
+		state = finder->next[state * finder->no_classes
+			+ finder->class[text[i]]];
+		if (state == finder->dead)
+			return false;
+	}
+	return finder->accept[state] || finder->accept_end[state];
+}
+
+/**
+ * Find out if the cell contains the pattern. The window is compared from its
+ * last character and moves by Horspool's table, a single character is left
+ * to memchr.
+ */
+bool col_substr(const col_t *col, const finder_t *finder)
+{
+	if (finder->type == FIND_ANY)
+		return col_any_substr(col, finder);
+	if (finder->type == FIND_REGEX)
+		return col_match(col, finder);
+	int length = finder->length;
+	if (length > col->length)
+		return false;
+	if (length == 0)
+		return true;
+	const unsigned char *text = (const unsigned char *) col->content;
+	const unsigned char *pattern = (const unsigned char *) finder->pattern;
+	if (length == 1)
+		return memchr(text, pattern[0], col->length) != NULL;
+	unsigned char last = pattern[length - 1];
+	for (int pos = 0; pos <= col->length - length;
+			pos += finder->shift[text[pos + length - 1]])
+	{
+		if (text[pos + length - 1] == last
+				&& memcmp(text + pos, pattern, length - 1) == 0)
 			return true;
-			break;
-		case TABLE:
-			for (int i = 0; i < table->no_rows; i++)
-			{
-				for (int j = 0; j < table->rows[0].no_cols; j++)
-				{
-					if (col_substr(table->rows[i].cols[j], str))
-					{
-						new->row1 = i + 1; // since selections start at 1
-						new->col1 = j + 1; // since selections start at 1
-					}
-				}
-			}
-			if (new->row1 == 0 || new->col1 == 0)
-				return false;
+	}
+	return false;
+}
+
+bool find_substr_cell(table_t *table, selection_t old, selection_t *current,
+		selection_t *new, call_t *call)
+{
+	const finder_t *finder = selection_finder(table, current, call);
+	new->type = CELL;
+	cell_iter_t iter;
+	// The last match wins, so cells are looked at from the end and the first
+	// match ends it
+	selection_iter(table, old, &iter, true);
+	while (iter_prev(&iter))
+	{
+		if (col_substr(table_cell(table, iter.row, iter.col), finder))
+		{
+			new->row1 = iter.row + 1; // since selections start at 1
+			new->col1 = iter.col + 1; // since selections start at 1
 			return true;
-			break;
-		case MIN:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case MAX:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case STR:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case TMP_VAR:
-			// This will not occur since it will be replaced by CELL
-			break;
-		case INVALID_S:
-			// This will never occur
-			break;
+		}
+	}
+	return false;
+}
+
+writer_t writer_ctor(FILE *file, table_t *table)
+{
+	writer_t new = { .file = file, .buf = NULL, .size = WRITE_BLOCK,
+		.len = 0, .written = 0 };
+	new.buf = malloc(new.size);
+	if (new.buf == NULL)
+		alloc_fail_table(table);
+	return new;
+}
+
+// Write out what is in the buffer
+void writer_flush(writer_t *writer)
+{
+	fwrite(writer->buf, 1, writer->len, writer->file);
+	writer->len = 0;
+}
+
+void writer_dtor(writer_t *writer)
+{
+	if (writer->file != NULL)
+		writer_flush(writer);
+	free(writer->buf);
+	writer->buf = NULL;
+}
+
+/**
+ * Make sure there is space for count more bytes in the buffer
+ * @return boolean - false if the buffer had to grow and allocation failed
+ */
+bool writer_reserve(writer_t *writer, size_t count)
+{
+	if (writer->size - writer->len >= count)
+		return true;
+	size_t size = writer->len + count;
+	if (writer->file != NULL)
+	{
+		writer_flush(writer);
+		if (writer->size >= count)
+			return true;
+		size = count;
+	}
+	else if (size < writer->size * 2)
+		size = writer->size * 2;
+	char *new_ptr = realloc(writer->buf, size);
+	if (new_ptr == NULL)
+		return false;
+	writer->buf = new_ptr;
+	writer->size = size;
+	return true;
+}
+
+bool writer_put(writer_t *writer, const char *string, size_t length)
+{
+	if (!writer_reserve(writer, length))
+		return false;
+	memcpy(writer->buf + writer->len, string, length);
+	writer->len += length;
+	writer->written += length;
+	return true;
+}
+
+/**
+ * Find the first of stop characters, with SSE2 or AVX2 16 or 32 bytes are
+ * compared at once, the rest is done one by one
+ * @param const char *p - where to start looking
+ * @param const char *end - end of the data
+ * @param const delim_t *delim - stops holds the characters to look for
+ * @param int no_stops - how many of delim->stops to look for
+ * @param int classes - CLASS_* of the same characters for the rest
+ * @return const char* - first stop character, end if there is none
+ */
+const char *scan_stops(const char *p, const char *end, const delim_t *delim,
+		int no_stops, int classes)
+{
+	const char *stops = delim->stops;
+#if defined(__AVX2__)
+	if (no_stops <= MAX_SIMD_STOPS)
+	{
+		__m256i wanted[MAX_SIMD_STOPS];
+		for (int i = 0; i < no_stops; i++)
+			wanted[i] = _mm256_set1_epi8(stops[i]);
+		for (; end - p >= 32; p += 32)
+		{
+			__m256i block = _mm256_loadu_si256((const __m256i *) p);
+			__m256i hit = _mm256_cmpeq_epi8(block, wanted[0]);
+			for (int i = 1; i < no_stops; i++)
+				hit = _mm256_or_si256(hit,
+						_mm256_cmpeq_epi8(block, wanted[i]));
+			unsigned mask = _mm256_movemask_epi8(hit);
+			if (mask != 0)
+				return p + __builtin_ctz(mask);
+		}
 	}
-	return true;
+#endif
+#if defined(__SSE2__)
+	if (no_stops <= MAX_SIMD_STOPS)
+	{
+		__m128i wanted[MAX_SIMD_STOPS];
+		for (int i = 0; i < no_stops; i++)
+			wanted[i] = _mm_set1_epi8(stops[i]);
+		for (; end - p >= 16; p += 16)
+		{
+			__m128i block = _mm_loadu_si128((const __m128i *) p);
+			__m128i hit = _mm_cmpeq_epi8(block, wanted[0]);
+			for (int i = 1; i < no_stops; i++)
+				hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, wanted[i]));
+			unsigned mask = _mm_movemask_epi8(hit);
+			if (mask != 0)
+				return p + __builtin_ctz(mask);
+		}
+	}
+#endif
+	while (p < end && !(delim->class[(unsigned char) *p] & classes))
+		p++;
+	return p;
 }
 
-void print_cell(FILE *file, char *content, char *delim)
+/**
+ * Write one cell, it is quoted if it contains a delimiter, backslashes and
+ * quotes are escaped
+ * @return boolean - false if allocation failed
+ */
+bool write_cell(writer_t *writer, const char *content, int length,
+		const delim_t *delim)
 {
-	int length = strlen(content);
 	bool contains_delim = false;
-	for (int i = 0; i < length; i++)
-		if (is_delim(content[i], delim))
+	int no_escapes = 0;
+	// Most cells contain nothing to quote or escape
+	const char *end = content + length;
+	const char *first = scan_stops(content, end, delim, delim->no_stops - 1,
+			CLASS_DELIM | CLASS_QUOTE | CLASS_BACKSLASH);
+	for (const char *c = first; c < end; c++)
+	{
+		int class = delim->class[(unsigned char) *c];
+		if (class == CLASS_QUOTE || class == CLASS_BACKSLASH)
+			no_escapes++;
+		else if (class == CLASS_DELIM)
 			contains_delim = true;
+	}
 
+	size_t total = length + no_escapes + (contains_delim ? 2 : 0);
+	if (!writer_reserve(writer, total))
+		return false;
+	char *out = writer->buf + writer->len;
 	if (contains_delim)
-		putc('\"', file);
-	for (int i = 0; i < length; i++)
+		*out++ = '\"';
+	if (no_escapes == 0)
+	{
+		memcpy(out, content, length);
+		out += length;
+	}
+	else
 	{
-		char cur = content[i];
-		if (cur == '\\' || cur == '\"')
+		for (int i = 0; i < length; i++)
 		{
-			putc('\\', file);
-			putc(cur, file);
+			if (content[i] == '\\' || content[i] == '\"')
+				*out++ = '\\';
+			*out++ = content[i];
 		}
-		else
-			putc(cur, file);
 	}
 	if (contains_delim)
-		putc('\"', file);
+		*out++ = '\"';
+	writer->len += total;
+	writer->written += total;
+	return true;
+}
+
+/**
+ * Write no_cols cells of a row separated by the first delimiter, without
+ * newline, cells past the ones stored in the row are empty
+ * @return boolean - false if allocation failed
+ */
+bool write_row(writer_t *writer, const row_t *row, int no_cols,
+		const delim_t *delim)
+{
+	int k = 0;	// next stored cell of a sparse row
+	for (int j = 0; j < no_cols; j++)
+	{
+		const col_t *cell = NULL;
+		if (row->index == NULL)
+			cell = j < row->no_cols ? &row->cols[j] : NULL;
+		else if (k < row->no_cols && row->index[k] == j)
+			cell = &row->cols[k++];
+		if (cell != NULL && !write_cell(writer, cell->content, cell->length,
+					delim))
+			return false;
+		// if not last column also print delimiter
+		if (j != no_cols - 1 && !writer_put(writer, delim->chars, 1))
+			return false;
+	}
+	return true;
+}
+
+// Rows from and up to to formatted in memory by one thread of write_table
+typedef struct
+{
+	writer_t writer;
+	table_t *table;
+	const delim_t *delim;
+	int from;
+	int to;
+	bool ok;	// false if allocation failed
+} write_job_t;
+
+void *write_job(void *arg)
+{
+	write_job_t *job = arg;
+	job->ok = true;
+	for (int i = job->from; i < job->to && job->ok; i++)
+		job->ok = write_row(&job->writer, table_row(job->table, i),
+				job->table->no_cols, job->delim)
+			&& writer_put(&job->writer, "\n", 1);
+	return NULL;
+}
+
+/**
+ * Print table with no_jobs threads, each formats WRITE_JOB_ROWS rows into a
+ * buffer of its own and then the buffers are written in order
+ */
+void write_parallel(FILE *file, table_t *table, const delim_t *delim,
+		int no_jobs)
+{
+	write_job_t jobs[MAX_JOBS];
+	pthread_t threads[MAX_JOBS];
+	bool started[MAX_JOBS] = { false };
+	for (int i = 0; i < no_jobs; i++)
+	{
+		jobs[i].writer = writer_ctor(NULL, table);
+		jobs[i].table = table;
+		jobs[i].delim = delim;
+	}
+	bool ok = true;
+	for (int row = 0; row < table->no_rows && ok;
+			row += no_jobs * WRITE_JOB_ROWS)
+	{
+		for (int i = 0; i < no_jobs; i++)
+		{
+			jobs[i].from = row + i * WRITE_JOB_ROWS;
+			if (jobs[i].from > table->no_rows)
+				jobs[i].from = table->no_rows;
+			jobs[i].to = jobs[i].from + WRITE_JOB_ROWS;
+			if (jobs[i].to > table->no_rows)
+				jobs[i].to = table->no_rows;
+		}
+		// First batch is formatted by this thread, as well as those of
+		// threads which could not be started
+		for (int i = 1; i < no_jobs; i++)
+			started[i] = jobs[i].from != jobs[i].to
+				&& pthread_create(&threads[i], NULL, write_job,
+						&jobs[i]) == 0;
+		for (int i = 0; i < no_jobs; i++)
+		{
+			if (started[i])
+				pthread_join(threads[i], NULL);
+			else
+				write_job(&jobs[i]);
+			ok = ok && jobs[i].ok;
+			fwrite(jobs[i].writer.buf, 1, jobs[i].writer.len, file);
+			jobs[i].writer.len = 0;
+		}
+	}
+	for (int i = 0; i < no_jobs; i++)
+		writer_dtor(&jobs[i].writer);
+	if (!ok)
+		alloc_fail_table(table);
 }
 
 /**
- * Print given table to standard output
+ * Print given table into file
+ * @param FILE *file - where to print it
  * @param table_t table - table which to print
- * @param char *delim - what to use as a delimiter
+ * @param delim_t *delim - what to use as a delimiter
+ * @param int no_jobs - how many threads to format rows with
  */
-void write_table(FILE *file, table_t table, char *delim)
+void write_table(FILE *file, table_t table, const delim_t *delim,
+		int no_jobs)
 {
+	// Every thread should get at least one batch of rows
+	if (table.no_rows / WRITE_JOB_ROWS < no_jobs)
+		no_jobs = table.no_rows / WRITE_JOB_ROWS;
+	if (no_jobs > 1)
+	{
+		write_parallel(file, &table, delim, no_jobs);
+		return;
+	}
+	writer_t writer = writer_ctor(file, &table);
 	for (int i = 0; i < table.no_rows; i++)
 	{
-		for (int j = 0; j < table.rows[i].no_cols; j++)
+		if (!write_row(&writer, table_row(&table, i), table.no_cols, delim)
+				|| !writer_put(&writer, "\n", 1))
 		{
-			print_cell(file, get_cell_content(&table, i, j), delim);
-			// if not last column also print delimiter
-			if (j != table.rows[i].no_cols - 1)
-				fprintf(file, "%c", delim[0]);
+			writer_dtor(&writer);
+			alloc_fail_table(&table);
 		}
-		fprintf(file, "\n");
 	}
+	writer_dtor(&writer);
 }
 
 /**
@@ -1056,139 +3164,479 @@ bool valid_delim(char *delim)
 	return true;
 }
 
+reader_t reader_ctor(FILE *file)
+{
+	reader_t new = { .file = file, .buf = NULL, .size = READ_BLOCK + 1,
+		.len = 0, .pos = 0, .mapped = false };
+	new.buf = malloc(new.size);
+	if (new.buf == NULL)
+	{
+		fclose(file);
+		alloc_fail_nothing();
+	}
+	return new;
+}
+
 /**
- * Return number of rows, load number of columns into the cols variable
- * @param FILE *file - file which to read
- * @param char *delim - what to use as delimiter
- * @param int *cols - where to store the number of columns
- * @return int - number of rows
+ * Map the whole file into memory instead of reading it, private mapping is
+ * used so that cells can be unescaped and terminated in place
+ * @return boolean - false if file can not be mapped, reader is left untouched
  */
-int get_sizes(FILE *file, char *delim, int *cols)
+bool reader_map(reader_t *reader)
 {
-	char c;
-	int no_rows = 0;
-	int cols_most = 0, cols_current = 0;
-	bool quote_open = false;
-	while ((c = fgetc(file)) != EOF)
+	struct stat st;
+	if (fstat(fileno(reader->file), &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	size_t page = sysconf(_SC_PAGESIZE);
+	// Last cell needs one more byte for '\0', it is only there for free if
+	// the file does not end exactly at the end of a page
+	if (st.st_size == 0 || st.st_size % page == 0)
+		return false;
+	char *map = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fileno(reader->file), 0);
+	if (map == MAP_FAILED)
+		return false;
+	free(reader->buf);
+	reader->buf = map;
+	reader->size = st.st_size + 1;
+	reader->len = st.st_size;
+	reader->mapped = true;
+	return true;
+}
+
+void reader_dtor(reader_t *reader)
+{
+	// Mapped buffer is handed over to the table
+	if (!reader->mapped)
+		free(reader->buf);
+	reader->buf = NULL;
+}
+
+/**
+ * Read next block of the file, the part of the unfinished cell between start
+ * and write is kept and moved to the beginning of the buffer
+ * @return boolean - false if there is nothing more to read
+ */
+bool reader_refill(reader_t *reader, size_t *start, size_t *write)
+{
+	if (reader->mapped)
+		return false;
+	size_t keep = *write - *start;
+	memmove(reader->buf, reader->buf + *start, keep);
+	*start = 0;
+	*write = keep;
+	// One byte is always left free for '\0' of the last cell
+	if (reader->size - keep - 1 < READ_BLOCK)
 	{
-		if (c == '\"')
-		{
-			if (!quote_open)
-				quote_open = true;
-			else
-				quote_open = false;
-		}
-		// Only count cols on first row
-		if (!quote_open && (is_delim(c, delim) || c == '\n'))
-			cols_current++;
-		if (c == '\n')
-		{
-			no_rows++;
-			if (cols_current > cols_most)
-				cols_most = cols_current;
-			cols_current = 0;
-		}
+		char *new_ptr = realloc(reader->buf, reader->size * 2);
+		if (new_ptr == NULL)
+			return false;
+		reader->buf = new_ptr;
+		reader->size *= 2;
 	}
-	rewind(file);
-	*cols = cols_most;
-	return no_rows;
+	reader->len = keep + fread(reader->buf + keep, 1,
+			reader->size - keep - 1, reader->file);
+	reader->pos = keep;
+	return reader->len > keep;
 }
 
 /**
- * Get what would be one cell in the table from the file
- * @param FILE *file - file to read
+ * Get what would be one cell in the table from the input
+ * @param reader_t *reader - input to read
  * @param char *delim - what to use as delimiter
- * @param int *size - size of the content buffer, can be resized since maximum
- * length of cell is not specified
- * @param char *content - string into which to store the read cell from file
- * @return int - SUCCESS if everything went OK, EOL if it was last cell of row
+ * @param char **content - where to store pointer to the '\0' terminated cell,
+ * valid only until the next call
+ * @param size_t *length - where to store length of the content
+ * @return int - SUCCESS if everything went OK, EOL if it was last cell of row,
+ * END_OF_INPUT if there was nothing more to read, UNBALANCED on open quote
  */
-int read_one_cell(table_t *table, FILE *file, char *delim, int *size,
-		char *content)
+int read_cell(reader_t *reader, const delim_t *delim, char **content,
+		size_t *length)
 {
-	int c;
 	bool quote_open = false;
 	bool escaped = false;
-	int chars_found = 1; // start with one for '\0'
-	while ((c = fgetc(file)) != EOF)
+	bool found = false; // if at least one character belongs to this cell
+	size_t start = reader->pos;
+	size_t write = reader->pos; // unescaped content is compacted in place
+	int ret = EOL; // input ending without newline ends the row as well
+	while (reader->pos < reader->len
+			|| reader_refill(reader, &start, &write))
 	{
-		chars_found++;
-		if (chars_found >= *size)
+		found = true;
+		// Skip over characters with no special meaning all at once
+		if (!escaped)
 		{
-			*size = *size * 2;
-			content = realloc(content, *size * sizeof(char));
-			if (content == NULL)
-				alloc_fail(table, file);
+			char *from = reader->buf + reader->pos;
+			const char *to = quote_open ?
+				scan_stops(from, reader->buf + reader->len, delim, 2,
+						CLASS_QUOTE | CLASS_BACKSLASH) :
+				scan_stops(from, reader->buf + reader->len, delim,
+						delim->no_stops, ~0);
+			size_t run = to - from;
+			if (write != reader->pos)
+				memmove(reader->buf + write, from, run);
+			write += run;
+			reader->pos += run;
+			if (reader->pos == reader->len)
+				continue;
 		}
+		char c = reader->buf[reader->pos++];
+		int class = delim->class[(unsigned char) c];
 		// Skip backslashes
-		if (c == '\\')
+		if (class == CLASS_BACKSLASH)
 		{
 			escaped = true;
 			continue;
 		}
 		// Handle quoting
-		if (c == '\"' && !escaped)
+		if (class == CLASS_QUOTE && !escaped)
 		{
-			if (!quote_open)
-				quote_open = true;
-			else
-				quote_open = false;
+			quote_open = !quote_open;
 			continue;
 		}
 		// End of cell
-		if (!quote_open && (c == '\n' || (is_delim(c, delim) && !escaped)))
+		if (!quote_open && class == CLASS_NEWLINE)
 			break;
-
-		*content++ = c;
+		if (!quote_open && class == CLASS_DELIM && !escaped)
+		{
+			ret = SUCCESS;
+			break;
+		}
+		reader->buf[write++] = c;
 		escaped = false;
 	}
-	*content++ = '\0';
 	if (quote_open)
+		return UNBALANCED;
+	if (!found)
+		return END_OF_INPUT;
+	reader->buf[write] = '\0';
+	*content = reader->buf + start;
+	*length = write - start;
+	return ret;
+}
+
+/**
+ * Append a cell to the row which is currently being loaded
+ * @return boolean - false if allocation failed
+ */
+bool load_cell(table_t *table, reader_t *reader, row_t *row,
+		char *content, size_t length)
+{
+	if (row->no_cols == row->size_cols)
 	{
-		fprintf(stderr,
-				"Unexpected input! Unbalanced quotes.\nTerminating...\n");
-		table_dtor(table);
-		fclose(file);
-		exit(EXIT_FAILURE);
+		col_t *new_ptr = realloc(row->cols,
+				row->size_cols * 2 * sizeof(col_t));
+		if (new_ptr == NULL)
+			return false;
+		row->size_cols = row->size_cols * 2;
+		row->cols = new_ptr;
+	}
+	col_t *col = &row->cols[row->no_cols];
+	*col = col_ctor();
+	col->length = length;
+	// Mapped content stays where it is, block buffer is reused so copy it
+	if (reader->mapped)
+		col->content = content;
+	else if (length != 0)
+		col->content = arena_store(table, content, length);
+	if (col->content == NULL)
+		return false;
+	row->no_cols++;
+	return true;
+}
+
+/**
+ * Move the loaded row into the table, row is left empty for the next one.
+ * Row with mostly empty cells is stored sparse.
+ * @return boolean - false if allocation failed
+ */
+bool load_row(table_t *table, row_t *row)
+{
+	// Gap stays at the end while loading
+	if (table->no_rows == table->size_rows)
+	{
+		row_t *new_ptr = realloc(table->rows,
+				table->size_rows * 2 * sizeof(row_t));
+		if (new_ptr == NULL)
+			return false;
+		table->size_rows = table->size_rows * 2;
+		table->rows = new_ptr;
+	}
+	row_t *new_row = &table->rows[table->no_rows];
+	int filled = row_filled(row);
+	if (row_sparse_enough(filled, row->no_cols))
+	{
+		if (!row_pack(new_row, row, filled))
+			return false;
 	}
-	if (c == '\n')
-		return EOL;
 	else
-		return SUCCESS;
+	{
+		*new_row = row_ctor(row->no_cols);
+		new_row->cols = malloc(row->no_cols * sizeof(col_t));
+		if (new_row->cols == NULL)
+			return false;
+		new_row->size_cols = row->no_cols;
+		memcpy(new_row->cols, row->cols, row->no_cols * sizeof(col_t));
+	}
+	table->no_rows++;
+	table->no_stored++;
+	table->gap++;
+	row->no_cols = 0;
+	return true;
 }
 
 /**
- * Fill table cell by cell
- * @param table_t *table - where to fill found values
- * @param File *file - where to get the values
- * @param char *delim - what to use as delimiter
- * @return int - SUCCESS if everything went OK
+ * Read all rows of the input into table, rows are not padded yet
+ * @param table_t *table - where to add the rows, no_rows is set to 0
+ * @param reader_t *reader - where to get the values
+ * @param delim_t *delim - what to use as delimiter
+ * @param int *cols_most - where to store the most cells found in a row
+ * @return int - SUCCESS, UNBALANCED on open quote or ALLOC_FAILED
+ */
+int load_rows(table_t *table, reader_t *reader, const delim_t *delim,
+		int *cols_most)
+{
+	*cols_most = 0;
+	table->no_rows = 0;
+	table->no_cols = 0;
+	table->no_stored = 0;
+	table->size_rows = CHUNK;
+	table->gap = 0;
+	table->rows = malloc(table->size_rows * sizeof(row_t));
+	row_t row = row_ctor(0);
+	row.size_cols = CHUNK;
+	row.cols = malloc(row.size_cols * sizeof(col_t));
+	if (table->rows == NULL || row.cols == NULL)
+	{
+		row_dtor(&row);
+		return ALLOC_FAILED;
+	}
+
+	char *content = NULL;
+	size_t length = 0;
+	int ret;
+	while ((ret = read_cell(reader, delim, &content, &length)) != END_OF_INPUT)
+	{
+		if (ret == UNBALANCED)
+			break;
+		if (!load_cell(table, reader, &row, content, length))
+		{
+			ret = ALLOC_FAILED;
+			break;
+		}
+		if (ret == EOL)
+		{
+			if (row.no_cols > *cols_most)
+				*cols_most = row.no_cols;
+			if (!load_row(table, &row))
+			{
+				ret = ALLOC_FAILED;
+				break;
+			}
+		}
+	}
+	// Last row ended by a delimiter right before the end of input
+	if (ret == END_OF_INPUT && row.no_cols != 0)
+	{
+		if (row.no_cols + 1 > *cols_most)
+			*cols_most = row.no_cols + 1;
+		if (!load_cell(table, reader, &row, "", 0)
+				|| !load_row(table, &row))
+			ret = ALLOC_FAILED;
+	}
+	row_dtor(&row);
+	return ret == END_OF_INPUT ? SUCCESS : ret;
+}
+
+/**
+ * Find where to split mapped input into chunks of about the same size, so
+ * that every chunk starts a new row. Row can only end by a newline outside
+ * of quotes and a quote is escaped if the character before is a backslash.
+ * @param const char *buf - the input
+ * @param size_t len - length of the input
+ * @param delim_t *delim - stops start with the quote
+ * @param size_t *bounds - where to store no_chunks + 1 offsets of chunks
+ * @param int no_chunks - how many chunks to make
+ */
+void split_rows(const char *buf, size_t len, const delim_t *delim,
+		size_t *bounds, int no_chunks)
+{
+	bool quote_open = false;
+	const char *p = buf;
+	const char *end = buf + len;
+	bounds[0] = 0;
+	for (int i = 1; i < no_chunks; i++)
+	{
+		const char *target = buf + len / no_chunks * i;
+		while (p < end)
+		{
+			const char *quote = scan_stops(p, end, delim, 1, CLASS_QUOTE);
+			const char *from = p > target ? p : target;
+			// Newlines until the next quote all end a row
+			if (!quote_open && quote > from)
+			{
+				const char *newline = memchr(from, '\n', quote - from);
+				if (newline != NULL)
+				{
+					p = newline + 1;
+					break;
+				}
+			}
+			if (quote != end && (quote == buf || quote[-1] != '\\'))
+				quote_open = !quote_open;
+			p = quote == end ? end : quote + 1;
+		}
+		bounds[i] = p - buf;
+	}
+	bounds[no_chunks] = len;
+}
+
+// One chunk of mapped input loaded into a table of its own
+typedef struct
+{
+	reader_t reader;
+	const delim_t *delim;
+	table_t table;
+	int cols_most;
+	int ret;	// what load_rows returned
+} load_job_t;
+
+void *load_job(void *arg)
+{
+	load_job_t *job = arg;
+	job->ret = load_rows(&job->table, &job->reader, job->delim,
+			&job->cols_most);
+	return NULL;
+}
+
+/**
+ * Load mapped input in no_jobs threads, each of them fills rows of its own
+ * chunk which are then joined in order
+ * @return int - SUCCESS, UNBALANCED on open quote or ALLOC_FAILED
  */
-void fill_table_with_data(table_t *table, FILE *file, char *delim)
+int load_parallel(table_t *table, reader_t *reader, const delim_t *delim,
+		int no_jobs, int *cols_most)
 {
-	int rows = table->no_rows;
-	int cols = table->rows[0].no_cols;
-	for (int i = 0; i < rows; i++)
+	size_t bounds[MAX_JOBS + 1];
+	load_job_t jobs[MAX_JOBS];
+	pthread_t threads[MAX_JOBS];
+	split_rows(reader->buf, reader->len, delim, bounds, no_jobs);
+	for (int i = 0; i < no_jobs; i++)
+	{
+		jobs[i].reader = *reader;
+		jobs[i].reader.buf = reader->buf + bounds[i];
+		jobs[i].reader.len = bounds[i + 1] - bounds[i];
+		jobs[i].reader.size = jobs[i].reader.len + 1;
+		jobs[i].delim = delim;
+		jobs[i].table = (table_t) { .no_rows = 0, .no_cols = 0,
+			.no_stored = 0, .size_rows = 0, .gap = 0, .rows = NULL,
+			.map = NULL, .arena = NULL, .shadows = NULL,
+			.size_shadows = 0 };
+	}
+	// First chunk is loaded by this thread, if a thread can not be started
+	// its chunk is loaded here as well
+	bool started[MAX_JOBS] = { false };
+	for (int i = 1; i < no_jobs; i++)
+		started[i] = pthread_create(&threads[i], NULL, load_job,
+				&jobs[i]) == 0;
+	for (int i = 0; i < no_jobs; i++)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			load_job(&jobs[i]);
+	}
+
+	int ret = SUCCESS;
+	int no_rows = 0;
+	*cols_most = 0;
+	for (int i = 0; i < no_jobs; i++)
 	{
-		int eol_found = 0; // If newline was already seen
-		for (int j = 0; j < cols; j++)
+		if (jobs[i].ret != SUCCESS && ret == SUCCESS)
+			ret = jobs[i].ret;
+		no_rows += jobs[i].table.no_rows;
+		if (jobs[i].cols_most > *cols_most)
+			*cols_most = jobs[i].cols_most;
+	}
+	table->no_rows = 0;
+	table->rows = ret == SUCCESS ? malloc((no_rows + 1) * sizeof(row_t))
+		: NULL;
+	if (ret == SUCCESS && table->rows == NULL)
+		ret = ALLOC_FAILED;
+	for (int i = 0; i < no_jobs; i++)
+	{
+		if (ret == SUCCESS)
 		{
-			int *size = &(table->rows[i].cols[j].size);
-			char *content = malloc(CHUNK * sizeof(char));
-			if (content == NULL)
-				alloc_fail(table, file);
-			if (!eol_found)
-				if(read_one_cell(table, file, delim, size, content) == EOL)
-					eol_found = 1;
-			// First cell where newline was found will still have content
-			if (eol_found == 2)
-				strcpy(content, "");
-			if (eol_found == 1)
-				eol_found ++;
-			fill_cell_value(file, table, i, j, content);
-			free(content);
+			memcpy(table->rows + table->no_rows, jobs[i].table.rows,
+					jobs[i].table.no_rows * sizeof(row_t));
+			table->no_rows += jobs[i].table.no_rows;
+			table->gap = table->size_rows = table->no_rows;
+			table->no_stored = table->no_rows;
+			jobs[i].table.no_rows = jobs[i].table.no_stored = 0;
 		}
+		table_dtor(&jobs[i].table);
+	}
+	return ret;
+}
+
+/**
+ * Fill table in one pass over the input, rows and columns are added as they
+ * are found. The table is as wide as the longest row.
+ * @param table_t *table - where to fill found values
+ * @param reader_t *reader - where to get the values
+ * @param delim_t *delim - what to use as delimiter
+ * @param int no_jobs - how many threads may load mapped input
+ */
+void load_table(table_t *table, reader_t *reader, const delim_t *delim,
+		int no_jobs)
+{
+	int cols_most;
+	table->no_rows = 0;
+	table->no_cols = 0;
+	table->no_stored = 0;
+	table->size_rows = 0;
+	table->gap = 0;
+	table->rows = NULL;
+	table->map = reader->mapped ? reader->buf : NULL;
+	table->map_len = reader->size;
+	table->arena = NULL;
+	table->shadows = NULL;
+	table->size_shadows = 0;
+	// Every thread should get enough work to be worth starting
+	if (!reader->mapped)
+		no_jobs = 1;
+	else if (reader->len / LOAD_JOB_MIN < (size_t) no_jobs)
+		no_jobs = reader->len / LOAD_JOB_MIN + 1;
+
+	int ret = no_jobs > 1 ?
+		load_parallel(table, reader, delim, no_jobs, &cols_most) :
+		load_rows(table, reader, delim, &cols_most);
+	if (ret == UNBALANCED)
+	{
+		fprintf(stderr,
+				"Unexpected input! Unbalanced quotes.\nTerminating...\n");
+		reader_dtor(reader);
+		fclose(reader->file);
+		table_dtor(table);
+		exit(EXIT_FAILURE);
+	}
+	if (ret == ALLOC_FAILED)
+	{
+		reader_dtor(reader);
+		fclose(reader->file);
+		alloc_fail_table(table);
 	}
+
+	if (table->no_rows != 0)
+	{
+		row_t *new_ptr = realloc(table->rows, table->no_rows * sizeof(row_t));
+		if (new_ptr == NULL)
+			alloc_fail(table, reader->file);
+		table->rows = new_ptr;
+		table->size_rows = table->no_rows;
+	}
+	// Shorter rows do not need to be padded, missing cells are empty
+	table->no_cols = cols_most;
 }
 
 int get_no_commas(const char *str)
@@ -1203,13 +3651,23 @@ int get_no_commas(const char *str)
 	return no_commas;
 }
 
+// Check if selection is in format [match REGEX], brackets included
+bool is_match_selection(char *selection)
+{
+	int length = strlen(selection);
+	return length > MATCH_LEN && strncmp("[match ", selection, MATCH_LEN) == 0
+		&& selection[length - 1] == ']';
+}
+
 /**
  * Selection should look something should be in []
- * 1, 3 or no commas are inside
+ * 1, 3 or no commas are inside, [match REGEX] may have any
  */
 bool is_selection(char *cmd)
 {
 	int length = strlen(cmd);
+	if (is_match_selection(cmd))
+		return true;
 	int no_commas = get_no_commas(cmd);
 
 	if (no_commas == 0 || no_commas == 1 || no_commas == 3)
@@ -1413,6 +3871,7 @@ bool is_find_selection(char *selection)
 	// Check if it begins with "find "
 	char test[FIND_LEN + 1];
 	memcpy(test, selection, FIND_LEN * sizeof(char));
+	test[FIND_LEN] = '\0';
 	if (strcmp("find ", test) != 0)
 		return false;
 
@@ -1422,12 +3881,23 @@ bool is_find_selection(char *selection)
 	return true;
 }
 
-// if in format [find STR], make selection into just STR
-void create_find_selection(char **selection)
+// Check if selection is in format [findany A|B]
+bool is_findany_selection(char *selection)
+{
+	if ((int) strlen(selection) <= FINDANY_LEN)
+		return false;
+	if (strncmp("findany ", selection, FINDANY_LEN) != 0)
+		return false;
+	return single_word(selection, FINDANY_LEN);
+}
+
+// if in format [find STR], make selection into just STR, skip is the length
+// of "find " or "findany "
+void create_find_selection(char **selection, int skip)
 {
 	int length = strlen(*selection);
-	for (int i = FIND_LEN; i < length + 1; i++)
-		(*selection)[i-FIND_LEN] = (*selection)[i];
+	for (int i = skip; i < length + 1; i++)
+		(*selection)[i-skip] = (*selection)[i];
 }
 
 bool is_box_selection(char *cmd, selection_t *sel)
@@ -1489,6 +3959,28 @@ selection_t load_selection_info(char *select_str, call_t *call)
 		s.type=TABLE;
 		return s;
 	}
+	// Regex is taken as it is, commas included, and compiled right away
+	if (is_match_selection(select_str))
+	{
+		int length = strlen(select_str) - MATCH_LEN - 1;
+		s.str = calloc(length + 1, sizeof(char));
+		s.finder = malloc(sizeof(finder_t));
+		if (s.str == NULL || s.finder == NULL)
+		{
+			free(s.str);
+			free(s.finder);
+			alloc_fail_call(call);
+		}
+		memcpy(s.str, select_str + MATCH_LEN, length * sizeof(char));
+		s.find = FIND_REGEX;
+		s.type = STR;
+		if (!regex_compile(s.finder, s.str, call))
+		{
+			selection_dtor(&s);
+			s.type = INVALID_S;
+		}
+		return s;
+	}
 	int no_commas = get_no_commas(select_str);
 	prepare_selection(&select_str);
 	char *endptr1 = NULL, *endptr2 = NULL;
@@ -1517,12 +4009,15 @@ selection_t load_selection_info(char *select_str, call_t *call)
 		s.type=MIN;
 	else if (strcmp(select_str, "max") == 0)
 		s.type=MAX;
-	else if(is_find_selection(select_str))
+	else if(is_find_selection(select_str) || is_findany_selection(select_str))
 	{
-		create_find_selection(&select_str);
+		if (is_findany_selection(select_str))
+			s.find = FIND_ANY;
+		create_find_selection(&select_str,
+				s.find == FIND_ANY ? FINDANY_LEN : FIND_LEN);
 		s.type = STR;
 		int length = strlen(select_str);
-		char *arg_str = calloc(length, sizeof(char));
+		char *arg_str = calloc(length + 1, sizeof(char));
 		if (arg_str == NULL)
 			alloc_fail_call(call);
 		strcpy(arg_str, select_str);
@@ -1641,8 +4136,10 @@ void unkown_command(call_t *call, char *current)
  */
 void load_command(char *cmd, int *no_commands, call_t *call)
 {
-	int size = CHUNK;
-	char *current = calloc(size, sizeof(char));
+	int length = strlen(cmd);
+	// No single command is longer than the whole string, [findany] lists
+	// easily outgrow a fixed CHUNK
+	char *current = calloc(length + 1, sizeof(char));
 	if (current == NULL)
 		alloc_fail_call(call);
 	int curr_i = 0;
@@ -1653,7 +4150,6 @@ void load_command(char *cmd, int *no_commands, call_t *call)
 		.row2=0, .col2=0, .str=NULL
 	};
 	call_add_selection(call, new);
-	int length = strlen(cmd);
 	for (int i = 0; i <= length; i++)
 	{
 		if (cmd[i] == ';' || i == length)
@@ -1702,21 +4198,189 @@ void load_command(char *cmd, int *no_commands, call_t *call)
  * @param char *file_name - file name to check
  * @return boolean - true if everything is OK
  */
-bool check_file(FILE *file, char *file_name)
+bool check_file(FILE *file, char *file_name)
+{
+	if (file_name == NULL)
+	{
+		fprintf(stderr, "File not given!\n");
+		return false;
+	}
+	if (file == NULL)
+	{
+		fprintf(stderr, "File %s could not be opened!\n", file_name);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Follow symbolic links from file_name to the file they end at, so that the
+ * output replaces that file and not the link to it
+ * @return char* - allocated path, NULL if it could not be resolved
+ */
+char *resolve_links(const char *file_name)
+{
+	char *path = malloc(strlen(file_name) + 1);
+	if (path == NULL)
+	{
+		error_msg();
+		return NULL;
+	}
+	strcpy(path, file_name);
+	for (int i = 0; i < MAX_LINKS; i++)
+	{
+		struct stat st;
+		if (lstat(path, &st) != 0 || !S_ISLNK(st.st_mode))
+			return path;
+		// Some file systems report no length for links, the buffer grows
+		size_t size = st.st_size > 0 ? (size_t) st.st_size + 1 : CHUNK;
+		char *target = NULL;
+		ssize_t len;
+		while (true)
+		{
+			char *new_ptr = realloc(target, size);
+			if (new_ptr == NULL)
+			{
+				free(target);
+				free(path);
+				error_msg();
+				return NULL;
+			}
+			target = new_ptr;
+			len = readlink(path, target, size);
+			if (len < 0 || (size_t) len < size)
+				break;
+			size *= 2;
+		}
+		if (len < 0)
+		{
+			free(target);
+			return path;
+		}
+		// Relative target is relative to the directory of the link
+		const char *slash = strrchr(path, '/');
+		size_t dir = target[0] != '/' && slash != NULL ? slash - path + 1 : 0;
+		char *next = malloc(dir + len + 1);
+		if (next == NULL)
+		{
+			free(target);
+			free(path);
+			error_msg();
+			return NULL;
+		}
+		memcpy(next, path, dir);
+		memcpy(next + dir, target, len);
+		next[dir + len] = '\0';
+		free(target);
+		free(path);
+		path = next;
+	}
+	fprintf(stderr, "Too many symbolic links in %s!\n", file_name);
+	free(path);
+	return NULL;
+}
+
+/**
+ * Open temporary file next to the file file_name leads to, owner, group and
+ * permissions are copied from it if it already exists, otherwise permissions
+ * follow the umask. Files which are not regular or have more links are not
+ * replaced, a new file would not be them anymore.
+ * @param output_t *out - where to store the opened output
+ * @param char *file_name - final destination, "-" for standard output
+ * @return boolean - true if everything went OK
+ */
+bool output_open(output_t *out, char *file_name)
 {
-	if (file_name == NULL)
+	out->file = stdout;
+	out->name = NULL;
+	out->tmp_name = NULL;
+	if (strcmp(file_name, "-") == 0)
+		return true;
+
+	char *name = resolve_links(file_name);
+	if (name == NULL)
+		return false;
+	struct stat st;
+	bool exists = stat(name, &st) == 0;
+	if (exists && (!S_ISREG(st.st_mode) || st.st_nlink > 1))
 	{
-		fprintf(stderr, "File not given!\n");
+		fprintf(stderr, "File %s is not a regular file with a single link, "
+				"it cannot be replaced!\n", file_name);
+		free(name);
 		return false;
 	}
-	if (file == NULL)
+	out->name = name;
+	out->tmp_name = malloc(strlen(name) + sizeof(TMP_SUFFIX));
+	if (out->tmp_name == NULL)
 	{
-		fprintf(stderr, "File %s could not be opened!\n", file_name);
+		error_msg();
+		free(out->name);
+		return false;
+	}
+	strcpy(out->tmp_name, name);
+	strcat(out->tmp_name, TMP_SUFFIX);
+	int fd = mkstemp(out->tmp_name);
+	if (fd != -1)
+	{
+		if (exists)
+		{
+			// Owner may not be given away, the group alone may be kept then
+			if (fchown(fd, st.st_uid, st.st_gid) != 0)
+				if (fchown(fd, -1, st.st_gid) != 0)
+					st.st_mode &= ~(S_ISUID | S_ISGID);
+			fchmod(fd, st.st_mode & 07777);
+		}
+		else
+		{
+			// New file gets the permissions fopen would have given it
+			mode_t mask = umask(0);
+			umask(mask);
+			fchmod(fd, 0666 & ~mask);
+		}
+		out->file = fdopen(fd, "w");
+		if (out->file == NULL)
+		{
+			close(fd);
+			remove(out->tmp_name);
+		}
+	}
+	if (fd == -1 || out->file == NULL)
+	{
+		fprintf(stderr, "Temporary file for %s could not be created!\n",
+				file_name);
+		free(out->tmp_name);
+		free(out->name);
 		return false;
 	}
 	return true;
 }
 
+/**
+ * Make the written result durable and put it in place of the target by
+ * rename, so that readers see either the old or the new table, never a part
+ * @param output_t *out - output opened by output_open
+ * @return boolean - true if everything went OK, the temporary file is
+ * removed otherwise and the target is left as it was
+ */
+bool output_commit(output_t *out)
+{
+	if (out->name == NULL)
+		return fflush(stdout) == 0;
+
+	bool ok = fflush(out->file) == 0 && !ferror(out->file)
+		&& fsync(fileno(out->file)) == 0;
+	ok = fclose(out->file) == 0 && ok;
+	ok = ok && rename(out->tmp_name, out->name) == 0;
+	if (!ok)
+	{
+		fprintf(stderr, "File %s could not be written!\n", out->name);
+		remove(out->tmp_name);
+	}
+	free(out->tmp_name);
+	free(out->name);
+	return ok;
+}
+
 bool cmd_parse(char *cmd, int *no_cmd, call_t *call)
 {
 	if (cmd == NULL)
@@ -1736,107 +4400,91 @@ bool cmd_parse(char *cmd, int *no_cmd, call_t *call)
 }
 
 /**
- * Create, fill, print and destroy a table
+ * Create and fill a table, the file is read just once so it can be a pipe
  * @param FILE *file - file to use for content
- * @param char *delim - what to use as delimiter
+ * @param delim_t *delim - what to use as delimiter
+ * @param table_t *table - where to store the table
+ * @param int no_jobs - how many threads to load the table with
  * @return boolean - true if everything went OK
  */
-bool table_handling(FILE *file, char *delim, table_t *table)
+bool table_handling(FILE *file, const delim_t *delim, table_t *table,
+		int no_jobs)
 {
-	int cols = 0;
-	int rows = get_sizes(file, delim, &cols);
-	*table = table_ctor(rows, cols, file);
-	fill_table_with_data(table, file, delim);
-	fclose(file);
+	reader_t reader = reader_ctor(file);
+	reader_map(&reader);
+	load_table(table, &reader, delim, no_jobs);
+	reader_dtor(&reader);
+	if (file != stdin)
+		fclose(file);
 	return true;
 }
 
 
 // Row manipulation
-void move_row(table_t *table, int index_from, int index_to)
-{
-	if (index_from > index_to)
-	{
-		while (index_from > index_to)
-		{
-			row_swap(&table->rows[index_from], &table->rows[index_from - 1]);
-			index_from--;
-		}
-	}
-	else
-	{
-		while (index_from < index_to)
-		{
-			row_swap(&table->rows[index_from], &table->rows[index_from + 1]);
-			index_from++;
-		}
-	}
-}
-
 void add_row_before(table_t *table, int row)
 {
-	table_add_rows(table, 1);
-	move_row(table, table->no_rows - 1, row);
-
+	table_insert_rows(table, row, 1);
 }
 
 void add_row_after(table_t *table, int row)
 {
-	table_add_rows(table, 1);
-	move_row(table, table->no_rows - 1, row + 1);
+	table_insert_rows(table, row + 1, 1);
 }
 
 void delete_row(table_t *table, int row)
 {
-	move_row(table, row, table->no_rows - 1);
-	table_delete_row(table);
+	table_remove_row(table, row);
 }
 
-// Column manipulation
-void move_col(table_t *table, int index_from, int index_to)
+// Column manipulation, every stored row is changed with a single move of its
+// cells, rows which do not store the column have nothing to move
+void add_col_before(table_t *table, int col)
 {
-	for (int i = 0; i < table->no_rows; i++)
-	{
-		int local_from = index_from;
-		int local_to = index_to;
-		if (local_from > local_to)
-		{
-			while (local_from > local_to)
-			{
-				col_swap(&table->rows[i].cols[local_from],
-						&table->rows[i].cols[local_from - 1]);
-				local_from--;
-			}
-		}
-		else
-		{
-			while (local_from < local_to)
-			{
-				col_swap(&table->rows[i].cols[local_from],
-						&table->rows[i].cols[local_from + 1]);
-				local_from++;
-			}
-		}
-	}
+	table_spread_shadows(table, col, col, false);
+	for (int i = 0; i < table->no_stored; i++)
+		row_insert_col(table_stored_row(table, i), table, col);
+	table->no_cols++;
 }
 
-void add_col_before(table_t *table, int col)
+void add_col_after(table_t *table, int col)
 {
-	table_add_cols(table, 1);
-	move_col(table, table->rows[0].no_cols - 1, col);
-
+	add_col_before(table, col + 1);
 }
 
-void add_col_after(table_t *table, int col)
+/**
+ * Remove columns first to last of the table
+ */
+void delete_cols(table_t *table, int first, int last)
 {
-	table_add_cols(table, 1);
-	move_col(table, table->rows[0].no_cols - 1, col + 1);
+	if (last >= table->no_cols)
+		last = table->no_cols - 1;
+	if (first > last)
+		return;
+	table_remove_shadows(table, first, last);
+	for (int i = 0; i < table->no_stored; i++)
+		row_remove_cols(table_stored_row(table, i), first, last);
+	table->no_cols -= last - first + 1;
 }
 
 void delete_col(table_t *table, int col)
 {
-	move_col(table, col, table->rows[0].no_cols - 1);
-	table_delete_col(table);
+	delete_cols(table, col, col);
+}
+
+/**
+ * Add an empty column in front of or after each of columns first to last
+ */
+void spread_cols(table_t *table, int first, int last, bool after)
+{
+	if (last >= table->no_cols)
+		last = table->no_cols - 1;
+	if (first > last)
+		return;
+	table_spread_shadows(table, first, last, after);
+	for (int i = 0; i < table->no_stored; i++)
+		row_spread_cols(table_stored_row(table, i), table, first, last,
+				after);
+	table->no_cols += last - first + 1;
 }
 
 /*
@@ -1927,21 +4575,16 @@ void icol(table_t *table, command_t cmd)
 	if (cmd.selection->type == CELL || cmd.selection->type == COL)
 		add_col_before(table, col);
 	else if (cmd.selection->type == ROW || cmd.selection->type == TABLE)
-	{
-		for (int i = 0; i < table->rows[0].no_cols; i +=2)
-			add_col_before(table, i);
-	}
+		spread_cols(table, 0, table->no_cols - 1, false);
 	else if (cmd.selection->type == BOX)
 	{
 		int col_start = cmd.selection->col1 - 1;
 		int col_end = cmd.selection->col2;
 		if (col_end == SLASH)
-			col_end = table->rows[0].no_cols - 1;
+			col_end = table->no_cols - 1;
 		else
 			col_end--; // the -1 missing in declaration unlike col_start
-		int max_step = col_start + 2 * (col_end - col_start) + 1;
-		for (int i = col_start; i < max_step; i +=2)
-			add_col_before(table, i);
+		spread_cols(table, col_start, col_end, false);
 	}
 }
 
@@ -1951,21 +4594,16 @@ void acol(table_t *table, command_t cmd)
 	if (cmd.selection->type == CELL || cmd.selection->type == COL)
 		add_col_after(table, col);
 	else if (cmd.selection->type == ROW || cmd.selection->type == TABLE)
-	{
-		for (int i = 0; i < table->rows[0].no_cols; i +=2)
-			add_col_after(table, i);
-	}
+		spread_cols(table, 0, table->no_cols - 1, true);
 	else if (cmd.selection->type == BOX)
 	{
 		int col_start = cmd.selection->col1 - 1;
 		int col_end = cmd.selection->col2;
 		if (col_end == SLASH)
-			col_end = table->rows[0].no_cols - 1;
+			col_end = table->no_cols - 1;
 		else
 			col_end--; // the -1 missing in declaration unlike col_start
-		int max_step = col_start + 2 * (col_end - col_start) + 1;
-		for (int i = col_start; i < max_step; i +=2)
-			add_col_after(table, i);
+		spread_cols(table, col_start, col_end, true);
 	}
 }
 
@@ -1981,13 +4619,10 @@ void dcol(table_t *table, command_t cmd)
 		int col_start = cmd.selection->col1 - 1;
 		int col_end = cmd.selection->col2;
 		if (col_end == SLASH)
-			col_end = table->rows[0].no_cols - 1;
+			col_end = table->no_cols - 1;
 		else
 			col_end--; // the -1 missing in declaration unlike col_start
-		int max_step = col_start + col_end - col_start + 1;
-		// Same as icol but there won't be new extra empty lines
-		for (int i = col_start; i < max_step; i++)
-			delete_col(table, col_start);
+		delete_cols(table, col_start, col_end);
 	}
 }
 
@@ -2009,7 +4644,7 @@ void set_selection(table_t *table, selection_t *selection, char *value)
 	if (stype == CELL)
 		set_cell_value(table, row1, col1, value, NULL);
 	else if (stype == ROW)
-		for (int i = 0; i < table->rows[row1].no_cols; i++)
+		for (int i = 0; i < table->no_cols; i++)
 			set_cell_value(table, row1, i, value, NULL);
 	else if (stype == COL)
 		for (int i = 0; i < table->no_rows; i++)
@@ -2019,14 +4654,14 @@ void set_selection(table_t *table, selection_t *selection, char *value)
 			if (selection->row2 == SLASH)
 				selection->row2 = table->no_rows;
 			if (selection->col2 == SLASH)
-				selection->col2 = table->rows[0].no_cols;
+				selection->col2 = table->no_cols;
 			for (int i = row1; i < selection->row2; i++)
 				for (int j = col1; j < selection->col2; j++)
 					set_cell_value(table, i, j, value, NULL);
 	}
 	else if (stype == TABLE)
 		for (int i = 0; i < table->no_rows; i++)
-			for (int j = 0; j < table->rows[i].no_cols; j++)
+			for (int j = 0; j < table->no_cols; j++)
 				set_cell_value(table, i, j, value, NULL);
 }
 
@@ -2043,6 +4678,22 @@ void clear(table_t *table, command_t cmd, call_t *call)
 	set_selection(table, cmd.selection, "");
 }
 
+/**
+ * Swap content of two cells, the cells get stored if they were not
+ */
+void swap_cells(table_t *table, int row1, int col1, int row2, int col2)
+{
+	if (table_cell(table, row1, col1)->length == 0
+			&& table_cell(table, row2, col2)->length == 0)
+		return;
+	// Second cell is stored first, so storing it can not move the first one
+	table_cell_write(table, row2, col2);
+	col_t *first = table_cell_write(table, row1, col1);
+	col_swap(first, table_cell_write(table, row2, col2));
+	table_cell_changed(table, row1, col1);
+	table_cell_changed(table, row2, col2);
+}
+
 void swap(table_t *table, command_t cmd, call_t *call)
 {
 	(void)call;
@@ -2052,32 +4703,28 @@ void swap(table_t *table, command_t cmd, call_t *call)
 	int col2 = cmd.arg2 - 1;
 	stype_t stype = cmd.selection->type;
 	if (stype == CELL)
-		col_swap(&table->rows[row1].cols[col1],
-				&table->rows[row2].cols[col2]);
+		swap_cells(table, row1, col1, row2, col2);
 	else if (stype == ROW)
-		for (int i = 0; i < table->rows[row1].no_cols; i++)
+		for (int i = 0; i < table->no_cols; i++)
 		{
-			col_swap(&table->rows[row1].cols[i],
-				&table->rows[row2].cols[col2]);
+			swap_cells(table, row1, i, row2, col2);
 		}
 	else if (stype == COL)
 		for (int i = 0; i < table->no_rows; i++)
 		{
-			col_swap(&table->rows[i].cols[col1],
-				&table->rows[row2].cols[col2]);
+			swap_cells(table, i, col1, row2, col2);
 		}
 	else if (stype == BOX)
 	{
 			if (cmd.selection->row2 == SLASH)
 				cmd.selection->row2 = table->no_rows;
 			if (cmd.selection->col2 == SLASH)
-				cmd.selection->col2 = table->rows[0].no_cols;
+				cmd.selection->col2 = table->no_cols;
 			for (int i = row1; i < cmd.selection->row2; i++)
 			{
 				for (int j = col1; j < cmd.selection->col2; j++)
 				{
-					col_swap(&table->rows[i].cols[j],
-						&table->rows[row2].cols[col2]);
+					swap_cells(table, i, j, row2, col2);
 				}
 			}
 	}
@@ -2085,10 +4732,9 @@ void swap(table_t *table, command_t cmd, call_t *call)
 	{
 		for (int i = 0; i < table->no_rows; i++)
 		{
-			for (int j = 0; j < table->rows[i].no_cols; j++)
+			for (int j = 0; j < table->no_cols; j++)
 				{
-					col_swap(&table->rows[i].cols[j],
-						&table->rows[row2].cols[col2]);
+					swap_cells(table, i, j, row2, col2);
 				}
 		}
 	}
@@ -2110,20 +4756,28 @@ double selection_sum(table_t *table, selection_t *selection, int *no_additions)
 	}
 	else if (stype == ROW)
 	{
-		for (int i = 0; i < table->rows[row1].no_cols; i++)
+		const row_t *row = table_row(table, row1);
+		for (int i = 0; i < table->no_cols; i++)
 		{
-			if (get_cell_numeric(table, row1, i, &current))
+			if (cell_numeric(row_cell(row, i), &current))
 				*no_additions+=1;
-			sum += current;
+			// First NaN is kept, whichever operand the compiler puts first
+			if (!isnan(sum))
+				sum += current;
 		}
 	}
 	else if (stype == COL)
 	{
+		if (table_shadows(table, table->no_rows, col1, col1 + 1)
+				&& table_shadows_exact(table, col1, col1 + 1))
+			return shadow_sum(column_shadow(table, col1), 0, table->no_rows,
+					no_additions);
 		for (int i = 0; i < table->no_rows; i++)
 		{
 			if (get_cell_numeric(table, i, col1, &current))
 				*no_additions+=1;
-			sum += current;
+			if (!isnan(sum))
+				sum += current;
 		}
 	}
 	else if (stype == BOX)
@@ -2131,61 +4785,126 @@ double selection_sum(table_t *table, selection_t *selection, int *no_additions)
 		if (selection->row2 == SLASH)
 			selection->row2 = table->no_rows;
 		if (selection->col2 == SLASH)
-			selection->col2 = table->rows[0].no_cols;
+			selection->col2 = table->no_cols;
+		// Shadows are summed column by column instead of row by row, and
+		// from blocks of their Fenwick trees
+		if ((table_built(table, col1, selection->col2, true)
+					|| table_shadows(table, selection->row2 - row1, col1,
+						selection->col2))
+				&& table_shadows_exact(table, col1, selection->col2))
+		{
+			for (int j = col1; j < selection->col2; j++)
+				sum += shadow_sum(column_shadow(table, j), row1,
+						selection->row2, no_additions);
+			return sum;
+		}
 		for (int i = row1; i < selection->row2; i++)
 		{
+			const row_t *row = table_row(table, i);
 			for (int j = col1; j < selection->col2; j++)
 			{
-				if (get_cell_numeric(table, i, j, &current))
+				if (cell_numeric(row_cell(row, j), &current))
 					*no_additions+=1;
-				sum += current;
+				if (!isnan(sum))
+					sum += current;
 			}
 		}
 	}
 	else if (stype == TABLE)
 	{
+		if (table_shadows(table, table->no_rows, 0, table->no_cols)
+				&& table_shadows_exact(table, 0, table->no_cols))
+		{
+			for (int j = 0; j < table->no_cols; j++)
+				sum += shadow_sum(column_shadow(table, j), 0,
+						table->no_rows, no_additions);
+			return sum;
+		}
 		for (int i = 0; i < table->no_rows; i++)
 		{
-			for (int j = 0; j < table->rows[i].no_cols; j++)
+			const row_t *row = table_row(table, i);
+			for (int j = 0; j < table->no_cols; j++)
 			{
-				if (get_cell_numeric(table, i, j, &current))
+				if (cell_numeric(row_cell(row, j), &current))
 					*no_additions+=1;
-				sum += current;
+				if (!isnan(sum))
+					sum += current;
 			}
 		}
 	}
 	return sum;
 }
 
+/**
+ * Write an integer same as "%d" does
+ * @param char *buf - where to write it, NUMBER_LEN characters are enough
+ * @return int - length of the text
+ */
+int format_int(char *buf, long value)
+{
+	char digits[NUMBER_LEN];
+	int len = 0;
+	unsigned long magnitude = value < 0 ? -(unsigned long) value
+		: (unsigned long) value;
+	do
+	{
+		digits[len++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude != 0);
+	int pos = 0;
+	if (value < 0)
+		buf[pos++] = '-';
+	while (len > 0)
+		buf[pos++] = digits[--len];
+	buf[pos] = '\0';
+	return pos;
+}
+
+/**
+ * Write a number same as "%g" does, integers with up to 6 digits are the
+ * usual results of sum and avg so they are written without snprintf
+ * @param char *buf - where to write it, NUMBER_LEN characters are enough
+ * @return int - length of the text
+ */
+int format_number(char *buf, double value)
+{
+	// NaN fails the range check before it could be converted
+	if (value > -1e6 && value < 1e6 && value == (long) value)
+	{
+		if (value == 0 && signbit(value))
+		{
+			strcpy(buf, "-0");
+			return 2;
+		}
+		return format_int(buf, (long) value);
+	}
+	return snprintf(buf, NUMBER_LEN, "%g", value);
+}
+
 void sum(table_t *table, command_t cmd, call_t *call)
 {
+	(void)call; // So that all data functions have the same type
 	int useless;
 	double sum = selection_sum(table, cmd.selection, &useless);
-	int alloc_size = snprintf(NULL, 0, "%g", sum) + 1;
-	char *text = malloc(alloc_size * sizeof(char));
-	if (text == NULL)
-		alloc_fail_table_call(table, call);
-	sprintf(text, "%g", sum);
-	set_cell_value(table, cmd.arg1 - 1, cmd.arg2 - 1, text, text);
-	free(text);
+	char text[NUMBER_LEN];
+	format_number(text, sum);
+	set_cell_value(table, cmd.arg1 - 1, cmd.arg2 - 1, text, NULL);
 }
 
 void avg(table_t *table, command_t cmd, call_t *call)
 {
+	(void)call; // So that all data functions have the same type
 	int count = 0;
 	double sum = selection_sum(table, cmd.selection, &count);
 	sum/=count;
-	int alloc_size = snprintf(NULL, 0, "%g", sum) + 1;
-	char *text = malloc(alloc_size * sizeof(char));
-	if (text == NULL)
-		alloc_fail_table_call(table, call);
-	sprintf(text, "%g", sum);
-	set_cell_value(table, cmd.arg1 - 1, cmd.arg2 - 1, text, text);
-	free(text);
+	char text[NUMBER_LEN];
+	format_number(text, sum);
+	set_cell_value(table, cmd.arg1 - 1, cmd.arg2 - 1, text, NULL);
 }
 
 void count(table_t *table, command_t cmd, call_t *call)
 {
+	(void)call; // So that all data functions have the same type
 	int store_row = cmd.arg1 - 1;
 	int store_col = cmd.arg2 - 1;
 	stype_t stype = cmd.selection->type;
@@ -2194,19 +4913,19 @@ void count(table_t *table, command_t cmd, call_t *call)
 	int non_empty = 0;
 	if (stype == CELL)
 	{
-		if (table->rows[row1].cols[col1].length != 0)
+		if (table_cell(table, row1, col1)->length != 0)
 			non_empty++;
 	}
 	else if (stype == ROW)
 	{
-		for (int i = 0; i < table->rows[row1].no_cols; i++)
-			if (table->rows[row1].cols[i].length != 0)
+		for (int i = 0; i < table->no_cols; i++)
+			if (table_cell(table, row1, i)->length != 0)
 				non_empty++;
 	}
 	else if (stype == COL)
 	{
 		for (int i = 0; i < table->no_rows; i++)
-			if (table->rows[i].cols[col1].length != 0)
+			if (table_cell(table, i, col1)->length != 0)
 				non_empty++;
 	}
 	else if (stype == BOX)
@@ -2214,31 +4933,42 @@ void count(table_t *table, command_t cmd, call_t *call)
 		if (cmd.selection->row2 == SLASH)
 			cmd.selection->row2 = table->no_rows;
 		if (cmd.selection->col2 == SLASH)
-			cmd.selection->col2 = table->rows[0].no_cols;
-		for (int i = row1; i < cmd.selection->row2; i++)
-			for (int j = col1; j < cmd.selection->col2; j++)
-				if (table->rows[i].cols[j].length != 0)
-					non_empty++;
+			cmd.selection->col2 = table->no_cols;
+		int row2 = cmd.selection->row2;
+		int col2 = cmd.selection->col2;
+		// Numbers are not parsed just to count cells, shadows left by sums
+		// are used though
+		if (table_built(table, col1, col2, false)
+				&& table_shadows(table, table->no_rows, col1, col2))
+		{
+			for (int j = col1; j < col2; j++)
+				non_empty += shadow_no_filled(column_shadow(table, j), row1,
+						row2);
+		}
+		else
+		{
+			for (int i = row1; i < row2; i++)
+				for (int j = col1; j < col2; j++)
+					if (table_cell(table, i, j)->length != 0)
+						non_empty++;
+		}
 	}
 	else if (stype == TABLE)
 	{
 		for (int i = 0; i < table->no_rows; i++)
-			for (int j = 0; j < table->rows[i].no_cols; j++)
-				if (table->rows[i].cols[j].length != 0)
+			for (int j = 0; j < table->no_cols; j++)
+				if (table_cell(table, i, j)->length != 0)
 					non_empty++;
 	}
 
-	int alloc_size = snprintf(NULL, 0, "%d", non_empty) + 1;
-	char *text = malloc(alloc_size * sizeof(char));
-	if (text == NULL)
-		alloc_fail_table_call(table, call);
-	sprintf(text, "%d", non_empty);
-	set_cell_value(table, store_row, store_col, text, text);
-	free(text);
+	char text[NUMBER_LEN];
+	format_int(text, non_empty);
+	set_cell_value(table, store_row, store_col, text, NULL);
 }
 
 void len(table_t *table, command_t cmd, call_t *call)
 {
+	(void)call; // So that all data functions have the same type
 	int store_row = cmd.arg1 - 1;
 	int store_col = cmd.arg2 - 1;
 
@@ -2251,22 +4981,19 @@ void len(table_t *table, command_t cmd, call_t *call)
 	if (stype == CELL)
 		len = strlen(get_cell_content(table, row1, col1));
 	else if (stype == ROW)
-		len = strlen(get_cell_content(table, row1, table->rows[0].no_cols - 1));
+		len = strlen(get_cell_content(table, row1,
+					table->no_cols - 1));
 	else if (stype == COL)
 		len = strlen(get_cell_content(table, table->no_rows - 1, col1));
 	else if (stype == BOX)
 		len = strlen(get_cell_content(table, row2, col2));
 	else if (stype == TABLE)
 		len = strlen(get_cell_content(table, table->no_rows -1 ,
-					table->rows[0].no_cols - 1));
+					table->no_cols - 1));
 
-	int alloc_size = snprintf(NULL, 0, "%d", len) + 1;
-	char *text = malloc(alloc_size * sizeof(char));
-	if (text == NULL)
-		alloc_fail_table_call(table, call);
-	sprintf(text, "%d", len);
-	set_cell_value(table, store_row, store_col, text, text);
-	free(text);
+	char text[NUMBER_LEN];
+	format_int(text, len);
+	set_cell_value(table, store_row, store_col, text, NULL);
 }
 
 void process_data(table_t *table, command_t cmd, call_t *call)
@@ -2306,13 +5033,9 @@ void inc(table_t *table, command_t cmd, variables_t *vars)
 	else
 		ret++;
 
-	int alloc_size = snprintf(NULL, 0, "%d", ret) + 1;
-	char *temp = malloc(alloc_size * sizeof(char));
-	 if (temp == NULL)
-		alloc_fail_table(table);
-	sprintf(temp, "%d", ret);
+	char temp[NUMBER_LEN];
+	format_int(temp, ret);
 	variable_store(table, vars, index, temp);
-	free(temp); // If variable_store fails it will leak!
 }
 
 void set_var(table_t *table, command_t cmd, variables_t *vars)
@@ -2350,15 +5073,15 @@ void table_expand(table_t *table, command_t command)
 			if (current > diff_r)
 				diff_r = current;
 		}
-		if (command.selection->col1 > table->rows[0].no_cols)
+		if (command.selection->col1 > table->no_cols)
 		{
-			current = command.selection->col1 - table->rows[0].no_cols;
+			current = command.selection->col1 - table->no_cols;
 			if (current > diff_c)
 				diff_c = current;
 		}
-		if (command.selection->col2 > table->rows[0].no_cols)
+		if (command.selection->col2 > table->no_cols)
 		{
-			current = command.selection->col2 - table->rows[0].no_cols;
+			current = command.selection->col2 - table->no_cols;
 			if (current > diff_c)
 				diff_c = current;
 		}
@@ -2370,25 +5093,27 @@ void table_expand(table_t *table, command_t command)
 		if (current > diff_r)
 			diff_r = current;
 	}
-	if (command.arg2 > table->rows[0].no_cols)
+	if (command.arg2 > table->no_cols)
 	{
-		current = command.arg2 - table->rows[0].no_cols;
+		current = command.arg2 - table->no_cols;
 		if (current > diff_c)
 			diff_c = current;
 	}
 
 	if (diff_r > 0)
-		table_add_rows(table, diff_r);
+		table_insert_rows(table, table->no_rows, diff_r);
+	// Added cells stay virtual until something is written to them
 	if (diff_c > 0)
-		table_add_cols(table, diff_c);
+		table->no_cols += diff_c;
 }
 
 void no_match_error(table_t *table, call_t *call, variables_t *vars)
 {
 	fprintf(stderr, "No match for selection!\n");
 	table_dtor(table);
-	call_dtor(call);
+	// vars may point at one of the call's selections, same order as main
 	variables_dtor(vars);
+	call_dtor(call);
 	exit(EXIT_FAILURE);
 }
 
@@ -2415,14 +5140,16 @@ bool apply_call(table_t *table, call_t *call, variables_t *vars)
 		{
 			// a bit of nasty pointer arithmetic, compensating for bad design,
 			// sadly do not have time to rewrite, selection before current one
-			if(find_min_cell(table, call->selections[selection - first - 1], &new))
+			if(find_extreme_cell(table, call->selections[selection - first - 1],
+						&new, false))
 				call->commands[i].selection = &new;
 			else
 				no_match_error(table, call, vars);
 		}
 		if (stype == MAX)
 		{
-			if(find_max_cell(table, call->selections[selection - first - 1], &new))
+			if(find_extreme_cell(table, call->selections[selection - first - 1],
+						&new, true))
 				call->commands[i].selection = &new;
 			else
 				no_match_error(table, call, vars);
@@ -2432,7 +5159,7 @@ bool apply_call(table_t *table, call_t *call, variables_t *vars)
 		if (stype == STR)
 		{
 			if (find_substr_cell(table, call->selections[selection - first - 1],
-						*selection, &new, call))
+						selection, &new, call))
 				call->commands[i].selection = &new;
 			else
 				no_match_error(table, call, vars);
@@ -2462,36 +5189,406 @@ bool apply_call(table_t *table, call_t *call, variables_t *vars)
 // Remove empty trailing columns
 void table_trim(table_t *table)
 {
-	bool non_empty = false;
-	// Go through all columns in reverse order if non empty break, else delete
+	int last = -1;
 	if (table->no_rows == 0)
 		return;
-	for (int i = table->rows[0].no_cols - 1; i > -1; i--)
+	// Only stored cells can be non empty, find the last one of every row
+	for (int i = 0; i < table->no_stored; i++)
 	{
-		for (int j = 0; j < table->no_rows; j++)
+		const row_t *row = table_stored_row(table, i);
+		for (int j = row->no_cols - 1; j >= 0; j--)
 		{
-			if (table->rows[j].cols[i].length != 0)
+			int col = row->index != NULL ? row->index[j] : j;
+			if (col <= last)
+				break;
+			if (row->cols[j].length != 0)
 			{
-				non_empty = true;
+				last = col;
 				break;
 			}
 		}
-		if (non_empty)
-			break;
+	}
+	delete_cols(table, last + 1, table->no_cols - 1);
+}
+
+/*
+ * Streaming
+ * Calls which only ever look at one row at a time are applied to each row as
+ * soon as it is read, so the table is never held in memory as a whole. Every
+ * command is a stage with its own row counter, rows flow from one stage to
+ * the next, so row numbers match the table as the previous commands left it.
+ */
+
+// Return if selection sel can be applied to every row on its own
+bool stream_selection(selection_t *sel)
+{
+	return sel->type == CELL || sel->type == ROW || sel->type == COL
+		|| sel->type == BOX || sel->type == TABLE;
+}
+
+/**
+ * Check if call can be applied in one forward pass over the rows
+ * @param call_t *call - parsed call
+ * @return boolean - true if every command only works with one row at a time
+ */
+bool call_streamable(call_t *call)
+{
+	for (int i = 0; i < call->count_c; i++)
+	{
+		command_t *cmd = &call->commands[i];
+		if (cmd->selection == NULL || !stream_selection(cmd->selection))
+			return false;
+		stype_t stype = cmd->selection->type;
+		if (cmd->type == DATA && cmd->cmd_num == CLEAR)
+			continue;
+		// Width of the whole table is not known before it is read
+		if (cmd->type == DATA && cmd->cmd_num == SET && (stype == CELL
+					|| stype == COL || (stype == BOX
+						&& cmd->selection->col2 != SLASH)))
+			continue;
+		if (cmd->type == MODIFICATION && (cmd->cmd_num == IROW
+					|| cmd->cmd_num == AROW || cmd->cmd_num == ICOL
+					|| cmd->cmd_num == ACOL))
+			continue;
+		// Deleting whole table is not worth it
+		if (cmd->type == MODIFICATION && (cmd->cmd_num == DROW
+					|| cmd->cmd_num == DCOL) && stype != TABLE
+				&& stype != (cmd->cmd_num == DROW ? COL : ROW))
+			continue;
+		return false;
+	}
+	return true;
+}
+
+// Return if index-th row (from 0) is part of the selection
+bool selection_has_row(selection_t *sel, int index)
+{
+	if (sel->type == COL || sel->type == TABLE)
+		return true;
+	if (sel->type == BOX)
+		return index >= sel->row1 - 1
+			&& (sel->row2 == SLASH || index < sel->row2);
+	return index == sel->row1 - 1;
+}
+
+// Number of rows the table must have for the command, see table_expand
+int stream_needed_rows(command_t *cmd)
+{
+	int needed = cmd->selection->row1;
+	if (cmd->selection->row2 > needed)
+		needed = cmd->selection->row2;
+	if (cmd->arg1 > needed)
+		needed = cmd->arg1;
+	return needed;
+}
+
+// Apply column modification to a single row, same as icol, acol and dcol
+void stream_col_mod(stream_t *stream, row_t *row, command_t *cmd)
+{
+	selection_t *sel = cmd->selection;
+	int col = sel->col1 - 1;
+	if (sel->type == CELL || sel->type == COL)
+	{
+		if (cmd->cmd_num == ICOL)
+			row_insert_col(row, &stream->table, col);
+		else if (cmd->cmd_num == ACOL)
+			row_insert_col(row, &stream->table, col + 1);
+		else
+			row_remove_cols(row, col, col);
+	}
+	else if (sel->type == ROW || sel->type == TABLE)
+		row_spread_cols(row, &stream->table, 0, row->no_cols - 1,
+				cmd->cmd_num == ACOL);
+	else if (sel->type == BOX)
+	{
+		int col_end = sel->col2 == SLASH ? row->no_cols - 1 : sel->col2 - 1;
+		if (cmd->cmd_num == DCOL)
+			row_remove_cols(row, col, col_end);
 		else
-			table_delete_col(table);
+			row_spread_cols(row, &stream->table, col, col_end,
+					cmd->cmd_num == ACOL);
+	}
+}
+
+// Apply set or clear to a single row
+void stream_data(stream_t *stream, row_t *row, command_t *cmd)
+{
+	selection_t *sel = cmd->selection;
+	char *value = cmd->cmd_num == SET ? cmd->str : "";
+	int col1 = sel->col1 - 1;
+	int col2 = col1;
+	if (sel->type == ROW || sel->type == TABLE
+			|| (sel->type == BOX && sel->col2 == SLASH))
+	{
+		// Only clear gets here, cells beyond the row are already empty
+		col1 = sel->type == BOX ? col1 : 0;
+		col2 = row->no_cols - 1;
+	}
+	else if (sel->type == BOX)
+		col2 = sel->col2 - 1;
+
+	if (cmd->cmd_num == SET && col2 >= row->no_cols)
+		row_add_cols(row, &stream->table, col2 - row->no_cols + 1);
+	table_t view = stream->table;
+	view.no_rows = view.no_stored = view.size_rows = view.gap = 1;
+	view.no_cols = row->no_cols;
+	view.rows = row;
+	for (int i = col1; i <= col2 && i < row->no_cols; i++)
+		set_cell_value(&view, 0, i, value, NULL);
+}
+
+// Free what the stream holds, along with its call
+void stream_dtor(stream_t *stream)
+{
+	free(stream->rows);
+	free(stream->writer.buf);
+	fclose(stream->tmp);
+	fclose(stream->tmp_lengths);
+	reader_dtor(&stream->reader);
+	call_dtor(stream->call);
+	table_dtor(&stream->table);
+}
+
+void stream_fail(stream_t *stream)
+{
+	error_msg();
+	stream_dtor(stream);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Append the row to the temporary output, without trailing empty cells, its
+ * length and number of cells are noted so it can be padded later
+ */
+void stream_output(stream_t *stream, row_t *row)
+{
+	int no_cols = row->no_cols;
+	while (no_cols > 0 && row->cols[no_cols - 1].length == 0)
+		no_cols--;
+	if (no_cols > stream->width)
+		stream->width = no_cols;
+	size_t start = stream->writer.written;
+	if (!write_row(&stream->writer, row, no_cols, stream->delim))
+		stream_fail(stream);
+	long length = stream->writer.written - start;
+	fwrite(&length, sizeof(length), 1, stream->tmp_lengths);
+	fwrite(&no_cols, sizeof(no_cols), 1, stream->tmp_lengths);
+}
+
+/**
+ * Pass the row through the stage and all stages after it
+ * @param stream_t *stream - the stream
+ * @param int stage - index of the command to apply
+ * @param row_t *row - row coming into the stage
+ */
+void stream_row(stream_t *stream, int stage, row_t *row)
+{
+	if (stage == stream->call->count_c)
+	{
+		stream_output(stream, row);
+		return;
+	}
+	command_t *cmd = &stream->call->commands[stage];
+	bool hit = selection_has_row(cmd->selection, stream->rows[stage]++);
+	if (cmd->type == DATA)
+	{
+		if (hit)
+			stream_data(stream, row, cmd);
+		stream_row(stream, stage + 1, row);
+		return;
+	}
+	row_t empty = row_ctor(0);
+	if (cmd->cmd_num == ICOL || cmd->cmd_num == ACOL || cmd->cmd_num == DCOL)
+		stream_col_mod(stream, row, cmd);
+	else if (hit && cmd->cmd_num == IROW)
+		stream_row(stream, stage + 1, &empty);
+	if (!hit || cmd->cmd_num != DROW)
+		stream_row(stream, stage + 1, row);
+	if (hit && cmd->cmd_num == AROW)
+		stream_row(stream, stage + 1, &empty);
+	row_dtor(&empty);
+}
+
+/**
+ * End of input, stages add rows their selections are missing just like
+ * table_expand would, from the first stage to the last
+ */
+void stream_flush(stream_t *stream)
+{
+	for (int i = 0; i < stream->call->count_c; i++)
+	{
+		int needed = stream_needed_rows(&stream->call->commands[i]);
+		while (stream->rows[i] < needed)
+		{
+			row_t empty = row_ctor(0);
+			stream_row(stream, i, &empty);
+			row_dtor(&empty);
+		}
+	}
+}
+
+// Forget all cells stored in the arena of the stream, keep the first block
+void arena_reset(table_t *table)
+{
+	if (table->arena == NULL)
+		return;
+	arena_block_t *next = table->arena->next;
+	table->arena->next = NULL;
+	table->arena->used = 0;
+	while (next != NULL)
+	{
+		arena_block_t *block = next;
+		next = next->next;
+		free(block);
+	}
+}
+
+/**
+ * Copy the temporary output into file, rows are padded with delimiters so
+ * that all of them have the same number of cells
+ */
+void stream_write(stream_t *stream, FILE *file)
+{
+	writer_dtor(&stream->writer);
+	rewind(stream->tmp);
+	rewind(stream->tmp_lengths);
+	stream->writer = writer_ctor(file, &stream->table);
+	writer_t *writer = &stream->writer;
+	long length;
+	int no_cols;
+	while (fread(&length, sizeof(length), 1, stream->tmp_lengths) == 1
+			&& fread(&no_cols, sizeof(no_cols), 1, stream->tmp_lengths) == 1)
+	{
+		// Rows are copied straight into the buffer of the writer
+		while (length > 0)
+		{
+			if (writer->len == writer->size)
+				writer_flush(writer);
+			size_t part = writer->size - writer->len;
+			if ((long) part > length)
+				part = length;
+			part = fread(writer->buf + writer->len, 1, part, stream->tmp);
+			if (part == 0)
+				break;
+			writer->len += part;
+			length -= part;
+		}
+		// Empty row still has one empty cell
+		for (int i = no_cols > 0 ? no_cols : 1; i < stream->width; i++)
+			writer_put(writer, stream->delim->chars, 1);
+		writer_put(writer, "\n", 1);
+	}
+	writer_dtor(writer);
+}
+
+/**
+ * Read, change and print the table one row at a time, call must be
+ * streamable (see call_streamable)
+ * @param FILE *file - file to use for content, it is closed
+ * @param char *out_name - where to write the result, "-" for stdout
+ * @param call_t *call - call to apply
+ * @return boolean - true if everything went OK
+ */
+bool stream_handling(FILE *file, char *out_name, call_t *call)
+{
+	stream_t stream = { .call = call, .rows = NULL, .tmp = tmpfile(),
+		.tmp_lengths = tmpfile(), .width = 0, .delim = call->delim,
+		.reader = reader_ctor(file) };
+	stream.table.no_rows = 0;
+	stream.table.no_cols = 0;
+	stream.table.no_stored = 0;
+	stream.table.size_rows = 0;
+	stream.table.gap = 0;
+	stream.table.rows = NULL;
+	stream.table.map = NULL;
+	stream.table.arena = NULL;
+	stream.table.shadows = NULL;
+	stream.table.size_shadows = 0;
+	if (stream.tmp == NULL || stream.tmp_lengths == NULL)
+	{
+		fprintf(stderr, "Temporary file could not be created!\n");
+		return false;
+	}
+	stream.writer = writer_ctor(stream.tmp, &stream.table);
+	stream.rows = calloc(call->count_c, sizeof(int));
+	if (stream.rows == NULL)
+		stream_fail(&stream);
+	for (int i = 0; i < call->count_c; i++)
+		if (call->commands[i].type == DATA && call->commands[i].cmd_num == SET)
+			unescape_string(call->commands[i].str, &stream.table, call);
+
+	row_t row = row_ctor(0);
+	char *content = NULL;
+	size_t length = 0;
+	int ret;
+	while ((ret = read_cell(&stream.reader, call->delim, &content, &length))
+			!= END_OF_INPUT)
+	{
+		if (ret == UNBALANCED)
+		{
+			fprintf(stderr,
+					"Unexpected input! Unbalanced quotes.\nTerminating...\n");
+			row_dtor(&row);
+			stream_dtor(&stream);
+			exit(EXIT_FAILURE);
+		}
+		row_add_cols(&row, &stream.table, 1);
+		col_t *col = &row.cols[row.no_cols - 1];
+		col->length = length;
+		if (length != 0)
+			col->content = arena_store(&stream.table, content, length);
+		if (col->content == NULL)
+			stream_fail(&stream);
+		if (ret == EOL)
+		{
+			stream_row(&stream, 0, &row);
+			row_clear(&row);
+			arena_reset(&stream.table);
+		}
+	}
+	// Last row ended by a delimiter right before the end of input
+	if (row.no_cols != 0)
+	{
+		row_add_cols(&row, &stream.table, 1);
+		stream_row(&stream, 0, &row);
+	}
+	row_dtor(&row);
+	stream_flush(&stream);
+	if (file != stdin)
+		fclose(file);
+
+	output_t out;
+	bool ok = output_open(&out, out_name);
+	if (ok)
+	{
+		stream_write(&stream, out.file);
+		ok = output_commit(&out);
 	}
+	else
+		free(stream.writer.buf);
+
+	reader_dtor(&stream.reader);
+	fclose(stream.tmp);
+	fclose(stream.tmp_lengths);
+	free(stream.rows);
+	table_dtor(&stream.table);
+	return ok;
 }
 
 int main(int argc, char **argv)
 {
-	char *delim=" ";
+	char *delim_chars=" ";
 	char *file_name = NULL;
+	char *out_name = NULL;	// where to write the result if not into file_name
+	int no_jobs = 1;	// threads loading and writing the table
 	int command_found = 0;
 	char *cmd = NULL;
 	int no_cmd = 0;
 	call_t call = call_ctor();
 	table_t table;
+#ifdef ALLOC_STATS
+	atexit(print_resizes);
+#endif
 
 	if (argc < 2)
 	{
@@ -2508,46 +5605,86 @@ int main(int argc, char **argv)
 				fprintf(stderr, "Delimiter not given!\n");
 				return EXIT_FAILURE;
 			}
-			delim = argv[i + 1];
+			delim_chars = argv[i + 1];
 			i++;
-			if (!valid_delim(delim))
+			if (!valid_delim(delim_chars))
 			{
 				fprintf(stderr, "Delimiter contains an invalid character!\n");
 				return EXIT_FAILURE;
 			}
 		}
+		else if (strcmp("-o", argv[i]) == 0)
+		{
+			if (i == argc - 1)
+			{
+				fprintf(stderr, "Output file not given!\n");
+				return EXIT_FAILURE;
+			}
+			out_name = argv[++i];
+		}
+		else if (strcmp("-j", argv[i]) == 0)
+		{
+			char *end = NULL;
+			if (i != argc - 1)
+				no_jobs = strtol(argv[++i], &end, 10);
+			if (end == NULL || *end != '\0' || no_jobs < 1
+					|| no_jobs > MAX_JOBS)
+			{
+				fprintf(stderr, "Number of threads must be 1 to %d!\n",
+						MAX_JOBS);
+				return EXIT_FAILURE;
+			}
+		}
 		else if (!command_found++)
 			cmd = argv[i];
 		else
 			file_name = argv[i];
 	}
 
-	call.delim = delim;
-
 	if (!cmd_parse(cmd, &no_cmd, &call))
 		return EXIT_FAILURE;
 
-	FILE *file = fopen(file_name, "r");
+	// "-" stands for standard input, the table is then printed to stdout
+	bool use_std = file_name != NULL && strcmp(file_name, "-") == 0;
+	FILE *file = use_std ? stdin : fopen(file_name, "r");
 
 	if (!check_file(file, file_name))
 		return EXIT_FAILURE;
+	if (out_name == NULL)
+		out_name = file_name;
+
+	delim_t delim = delim_ctor(delim_chars);
+	call.delim = &delim;
 
-	if (!table_handling(file, delim, &table))
+	if (call_streamable(&call))
+	{
+		bool ok = stream_handling(file, out_name, &call);
+		call_dtor(&call);
+		delim_dtor(&delim);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (!table_handling(file, &delim, &table, no_jobs))
 		return EXIT_FAILURE;
 
 	variables_t vars = variables_ctor(&call);
 	apply_call(&table, &call, &vars);
 
 	table_trim(&table);
-	file = fopen(file_name, "w");
-	if (!check_file(file, file_name))
-		return EXIT_FAILURE;
-	write_table(file, table, delim);
-	fclose(file);
+	// The input file is replaced only once the whole table is written, so
+	// the mapping cells borrow from stays valid all the time
+	output_t out;
+	bool ok = output_open(&out, out_name);
+	if (ok)
+	{
+		write_table(out.file, table, &delim, no_jobs);
+		ok = output_commit(&out);
+	}
 
 	variables_dtor(&vars);
 	table_dtor(&table);
 	call_dtor(&call);
+	delim_dtor(&delim);
 
-	return EXIT_SUCCESS;
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }